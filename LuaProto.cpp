@@ -1,27 +1,281 @@
 #include "lua/lua.hpp"
+#include <google/protobuf/arena.h>
 #include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/descriptor_database.h>
+#include <google/protobuf/dynamic_message.h>
 #include <google/protobuf/message.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/util/json_util.h>
+#include <google/protobuf/util/type_resolver.h>
+#include <google/protobuf/util/type_resolver_util.h>
+#include <google/protobuf/wire_format.h>
+#include <google/protobuf/wire_format_lite.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 namespace LuaModule {
 
+    struct FieldPlan;
+
+    typedef void (*PushHandler)(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan);
+    typedef void (*SetHandler)(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan);
+    typedef bool (*DecodeHandler)(lua_State *L, google::protobuf::io::CodedInputStream* input, const FieldPlan* plan);
+
+    struct MessagePlan;
+
+    // one entry per field, resolved once from label()/cpp_type()/is_map()
+    struct FieldPlan
+    {
+        const google::protobuf::FieldDescriptor* field;
+        int number;
+        google::protobuf::internal::WireFormatLite::WireType wiretype;
+        bool nopresence;                    // proto3 singular scalar, default value means absent
+        bool utf8;                          // proto3 string, the parser rejects invalid UTF-8
+        PushHandler push;
+        SetHandler set;
+        DecodeHandler decode;               // scalar wire value => lua value, nullptr for messages
+        const MessagePlan* sub;             // message type or map entry plan
+    };
+
+    // compiled lazily on first use, fields are indexed by FieldDescriptor::index()
+    struct MessagePlan
+    {
+        const google::protobuf::Descriptor* descriptor;
+        std::vector<FieldPlan> fields;
+        std::vector<int> numbers;           // field number => index + 1, for densely numbered fields
+        bool required;                      // the type or one it contains has required fields
+    };
+
+    // per lua_State codec state, lives in a full userdata upvalue
+    // size pass => write pass of the direct encoder
+    struct EncodeBuffer
+    {
+        std::string data;
+        std::vector<size_t> sizes;          // nested message / packed lengths in write order
+        size_t cursor;
+        bool busy;                          // handed out to an encode callback
+
+        EncodeBuffer() : cursor(0), busy(false) {}
+    };
+
+    // open addressing descriptor => plan table, at most half full so every probe ends on an empty slot
+    struct PlanTable
+    {
+        size_t mask;
+        std::unique_ptr<std::atomic<const MessagePlan*>[]> slots;
+
+        explicit PlanTable(size_t size) : mask(size-1), slots(new std::atomic<const MessagePlan*>[size]()) {}
+    };
+
+    // compiled plans of one descriptor pool, shared by every lua_State on that pool
+    // lookups probe the published table without locking, only a miss takes the lock to compile
+    // everything else a call touches (buffers, arena, pools, Lua caches) belongs to its own CodecState
+    struct PlanRegistry
+    {
+        std::atomic<PlanTable*> table;                      // published plans, replaced by a larger copy when it fills
+        std::recursive_mutex lock;                          // writers only, recursive as nested message types compile under the outer call
+        std::unordered_map<const google::protobuf::Descriptor*, std::unique_ptr<MessagePlan>> plans;  // every plan, published or not
+        std::vector<std::unique_ptr<PlanTable>> tables;     // current and retired tables, a reader may still probe an old one
+        std::vector<MessagePlan*> pending;                  // compiled by the running outer call, published when it returns
+        size_t published;
+        int depth;
+
+        PlanRegistry() : table(nullptr), published(0), depth(0) {}
+    };
+
+    // schema loaded at runtime, members are destroyed factory first, then pool, then database
+    struct LoadedSchema
+    {
+        google::protobuf::SimpleDescriptorDatabase database;
+        google::protobuf::DescriptorPool pool;
+        google::protobuf::DynamicMessageFactory factory;
+        PlanRegistry plans;
+
+        LoadedSchema() : pool(&database), factory(&pool) {}
+    };
+
+    // per type counters of option("stats"), times are in nanoseconds
+    // wirens is spent in protobuf parsing or serializing, tablens in converting between message and table,
+    // encode and decode work straight on the wire and count all of their time as tablens
+    // every codec call counts, a batch once per record with the length prefixes in its bytes; a lazy proxy counts its parse, not the fields read later,
+    // an async decode its worker parse and the table built by result(); tojson and fromjson make no table and are left out
+    struct TypeStats
+    {
+        google::protobuf::uint64 encodes;
+        google::protobuf::uint64 decodes;
+        google::protobuf::uint64 bytesout;
+        google::protobuf::uint64 bytesin;
+        google::protobuf::uint64 wirens;
+        google::protobuf::uint64 tablens;
+        google::protobuf::uint64 allocs;                    // messages allocated on the heap, arena and pool reuse excluded
+
+        TypeStats() : encodes(0), decodes(0), bytesout(0), bytesin(0), wirens(0), tablens(0), allocs(0) {}
+    };
+
+    struct CodecState
+    {
+        std::unique_ptr<LoadedSchema> schema;               // declared first so plans and pooled messages go before it
+        PlanRegistry* registry;                             // plans of the generated pool or of the loaded schema
+        EncodeBuffer encoder;
+        std::unique_ptr<char[]> arenablock;                 // initial arena block, the memory kept between calls
+        std::unique_ptr<google::protobuf::Arena> arena;     // declared after its block so it is destroyed first
+        size_t arenasize;
+        bool arenabusy;                                     // the arena holds the message of a running call
+        std::unordered_map<const google::protobuf::Descriptor*, std::vector<std::unique_ptr<google::protobuf::Message>>> pool;  // cleared messages for reuse
+        size_t poolsize;                                    // cleared messages kept per type, 0 = no pool
+        size_t poolhit;
+        size_t poolmiss;
+        size_t bytesview;                                   // bytes fields this long are pushed as views in a deserialize callback, 0 = off
+        bool viewing;                                       // a deserialize callback keeps its message alive
+        size_t typedarray;                                  // numeric repeated fields this long are pushed as typed arrays, 0 = off
+        bool enumnumber;                                    // enums are exchanged as numbers instead of names
+        bool delta;                                         // apply_delta is decoding, repeated fields are replaced and cleared lists honoured
+        int reuse;                                          // deserialize_into: stack index of the old table the next _newtable refills
+        int reusetop;                                       // stack top when it was offered, at any other top the offer is stale
+        bool stats;                                         // per type counters are collected
+        std::unordered_map<const google::protobuf::Descriptor*, TypeStats> typestats;
+        bool strict;                                        // malformed data returns nil, err instead of a partial table
+        int maxdepth;                                       // strict limits, 0 = none (protobuf's default depth)
+        size_t maxsize;
+        size_t maxrepeated;                                 // elements of one repeated field, or map entries
+        const char* failure;                                // why the running strict wire decode gave up, nullptr = malformed data
+        std::vector<size_t> entries;                        // map entries per field of each message the wire decoder has open, for maxrepeated
+        std::unique_ptr<google::protobuf::util::TypeResolver> resolver;  // types of the pool for tojson / fromjson, made on first use
+        std::string json;                                   // output buffer of tojson / fromjson, kept between calls
+
+        CodecState() : registry(nullptr), arenasize(0), arenabusy(false), poolsize(0), poolhit(0), poolmiss(0), bytesview(0), viewing(false), typedarray(0), enumnumber(false), delta(false), reuse(0), reusetop(0), stats(false),
+            strict(false), maxdepth(0), maxsize(0), maxrepeated(0), failure(nullptr) {}
+    };
+
+    // releases the temporary message of a call, arena messages go away with an arena Reset
+    struct MessageRelease
+    {
+        CodecState* pState;
+
+        void operator()(google::protobuf::Message* msg) const
+        {
+            if (msg->GetArena() != nullptr)
+            {
+                pState->arena->Reset();
+                pState->arenabusy = false;
+                return;
+            }
+
+            std::vector<std::unique_ptr<google::protobuf::Message>>* pFree = nullptr;
+            if (pState->poolsize > 0) pFree = &pState->pool[msg->GetDescriptor()];
+            if (pFree == nullptr || pFree->size() >= pState->poolsize)
+            {
+                delete msg;
+                return;
+            }
+            msg->Clear();                                   // keeps the capacity of strings and repeated fields
+            pFree->emplace_back(msg);
+        }
+    };
+
+    typedef std::unique_ptr<google::protobuf::Message, MessageRelease> MessagePtr;
+
+    // incremental decoder, the table being filled is the userdata's user value
+    // memory is bounded by the largest top level field, only a field split across chunks is buffered
+    struct StreamDecoder
+    {
+        const MessagePlan* plan;
+        std::string pending;                // start of a top level field still waiting for its remaining bytes
+        size_t need;                        // full size of that field once its header has arrived, 0 = not known yet
+        size_t fed;                         // bytes fed since the last finish, for maxsize
+        google::protobuf::uint64 tablens;   // time spent in feed since the last finish, for stats
+        std::vector<size_t> entries;        // map entries per top level field, for maxrepeated
+        bool failed;
+        const char* failure;                // strict mode: why failed was set
+    };
+
+    // message proxy converting fields on first access, converted values are cached in the user value table
+    // the root proxy owns the parsed message, sub message proxies keep the root alive at [0] of their cache
+    struct LazyMessage
+    {
+        const google::protobuf::Message* msg;
+        const MessagePlan* plan;
+        google::protobuf::Message* owned;
+    };
+
+    // compact array of a numeric repeated field, count elements of the field's native type follow the header
+    struct TypedArray
+    {
+        google::protobuf::FieldDescriptor::CppType type;
+        size_t count;
+    };
+
+    // message parsed on a worker thread, the handle waits for the worker before it goes away
+    struct AsyncDecode
+    {
+        std::unique_ptr<google::protobuf::Message> msg;
+        const void* data;                   // kept alive by the user value of the handle, or by the caller for a lightuserdata
+        size_t size;
+        std::mutex lock;
+        std::condition_variable finished;
+        bool done;
+        bool strict;                        // option("strict") and its limits when the job was queued
+        int maxdepth;
+        size_t maxsize, maxrepeated;
+        const MessagePlan* plan;
+        const char* failure;                // strict mode: why the worker rejected the data, nullptr when it parsed
+        std::string missing;                // required fields behind a "missing required fields" failure
+        google::protobuf::uint64 wirens;    // time the worker spent parsing, for stats
+    };
+
+    // pool, factory, prototype cache, codec state, interned keys, decoder metatable, lazy message metatable, field mask cache,
+    // typed array metatable, async decode metatable
+    static const int UPVALUES = 10;
+
+    // field number of the packed varint list of fields a delta clears, 0 is reserved so no schema field can collide
+    static const int DELTA_CLEARED = 0;
+
+    // type url prefix the json type resolver answers to
+    static const char* JSON_TYPE_URL = "type.googleapis.com";
+
+    // encode buffers above this size are released after use instead of kept for the next call
+    static const size_t ENCODE_BUFFER_RETAIN = 1 << 20;
+
     static void _msg2table(lua_State *L, const google::protobuf::Message* pMsg);
     static void _table2msg(lua_State *L, google::protobuf::Message* pMsg);
-    static void _pushfield(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const google::protobuf::FieldDescriptor *field);
-    static void _setfield(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const google::protobuf::FieldDescriptor *field);
+    static const MessagePlan* _getplan(lua_State *L, const google::protobuf::Descriptor* pDescriptor);
+    static int load(lua_State *L);
 
-    static google::protobuf::Message* _newmsg(lua_State *L, const char* name)
+    // name => prototype, looked up once per name and kept in the upvalue cache table
+    static const google::protobuf::Message* _getprototype(lua_State *L, int idx)
     {
         const google::protobuf::DescriptorPool* pDPool;
         google::protobuf::MessageFactory* pMFactory;
         const google::protobuf::Descriptor* pDescriptor;
         const google::protobuf::Message* pMessage;
 
+        lua_pushvalue(L, idx);
+        lua_rawget(L, lua_upvalueindex(3));
+        pMessage = (const google::protobuf::Message*)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+
+        if (pMessage) return pMessage;
+
         pDPool = (const google::protobuf::DescriptorPool*)lua_touserdata(L, lua_upvalueindex(1));
         pMFactory = (google::protobuf::MessageFactory*)lua_touserdata(L, lua_upvalueindex(2));
 
         if (pDPool == nullptr || pMFactory == nullptr) return nullptr;
 
-	    pDescriptor = pDPool->FindMessageTypeByName(name);
+        pDescriptor = pDPool->FindMessageTypeByName(lua_tostring(L, idx));
 
         if (pDescriptor == nullptr) return nullptr;
 
@@ -29,520 +283,3661 @@ namespace LuaModule {
 
         if (pMessage == nullptr) return nullptr;
 
-        return pMessage->New();
+        lua_pushvalue(L, idx);
+        lua_pushlightuserdata(L, (void*)pMessage);
+        lua_rawset(L, lua_upvalueindex(3));
+
+        return pMessage;
     }
 
-    static void _pushsingle(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const google::protobuf::FieldDescriptor *field)
+    static CodecState* _getstate(lua_State *L)
     {
-		switch (field->cpp_type())
-		{
-			case google::protobuf::FieldDescriptor::CPPTYPE_INT32: lua_pushinteger(L, pReflection->GetInt32(*pMsg, field)); break;
-			case google::protobuf::FieldDescriptor::CPPTYPE_INT64: lua_pushinteger(L, pReflection->GetInt64(*pMsg, field)); break;
-			case google::protobuf::FieldDescriptor::CPPTYPE_UINT32: lua_pushinteger(L, pReflection->GetUInt32(*pMsg, field)); break;
-			case google::protobuf::FieldDescriptor::CPPTYPE_UINT64: lua_pushinteger(L, pReflection->GetUInt64(*pMsg, field)); break;
-			case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE: lua_pushnumber(L, pReflection->GetDouble(*pMsg, field)); break;
-			case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT: lua_pushnumber(L, pReflection->GetFloat(*pMsg, field)); break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_BOOL: lua_pushboolean(L, pReflection->GetBool(*pMsg, field)); break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
-            {
-                auto valuetype = pReflection->GetEnum(*pMsg, field);
-                if (valuetype) lua_pushstring(L, valuetype->name().c_str());
-            } break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_STRING:
-            {
-                std::string str;
-                str = pReflection->GetStringReference(*pMsg, field, &str);
-                lua_pushlstring(L, str.c_str(), str.length());
-            } break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE:
-            {
-                auto &msg = pReflection->GetMessage(*pMsg, field);
-                _msg2table(L, &msg);
-            } break;
-            default: lua_pushnil(L); break;
-        }
+        return (CodecState*)lua_touserdata(L, lua_upvalueindex(4));
     }
 
-    static void _pusharray(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const google::protobuf::FieldDescriptor *field)
+    // counters of a type when option("stats") is on, otherwise nullptr
+    static TypeStats* _typestats(lua_State *L, const google::protobuf::Descriptor* pDescriptor)
     {
-        auto fieldsize = pReflection->FieldSize(*pMsg, field);
-        lua_createtable(L, fieldsize, 0);
-        switch (field->cpp_type())
+        CodecState* pState = _getstate(L);
+        return pState->stats ? &pState->typestats[pDescriptor] : nullptr;
+    }
+
+    static google::protobuf::uint64 _now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static int _stategc(lua_State *L)
+    {
+        CodecState* pState = (CodecState*)lua_touserdata(L, 1);
+        pState->~CodecState();
+        return 0;
+    }
+
+    // the message of a call goes on the arena when it is enabled and not taken by an outer call,
+    // otherwise it comes from the per type pool of cleared messages
+    static google::protobuf::Message* _newmsg(lua_State *L, int idx)
+    {
+        const google::protobuf::Message* pMessage;
+        CodecState* pState;
+
+        pMessage = _getprototype(L, idx);
+
+        if (pMessage == nullptr) return nullptr;
+
+        pState = _getstate(L);
+        if (pState->arena && !pState->arenabusy)
         {
-			case google::protobuf::FieldDescriptor::CPPTYPE_INT32:
-            {
-                for (int i=0;i<fieldsize;i++)
-                {
-                    lua_pushinteger(L, pReflection->GetRepeatedInt32(*pMsg, field, i));
-                    lua_rawseti(L, -2, i+1);
-                }
-            } break;
-			case google::protobuf::FieldDescriptor::CPPTYPE_INT64:
-            {
-                for (int i=0;i<fieldsize;i++)
-                {
-                    lua_pushinteger(L, pReflection->GetRepeatedInt64(*pMsg, field, i));
-                    lua_rawseti(L, -2, i+1);
-                }
-            } break;
-			case google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
-            {
-                for (int i=0;i<fieldsize;i++)
-                {
-                    lua_pushinteger(L, pReflection->GetRepeatedUInt32(*pMsg, field, i));
-                    lua_rawseti(L, -2, i+1);
-                }
-            } break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
-            {
-                for (int i=0;i<fieldsize;i++)
-                {
-                    lua_pushinteger(L, pReflection->GetRepeatedUInt64(*pMsg, field, i));
-                    lua_rawseti(L, -2, i+1);
-                }
-            } break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
-            {
-                for (int i=0;i<fieldsize;i++)
-                {
-                    lua_pushnumber(L, pReflection->GetRepeatedDouble(*pMsg, field, i));
-                    lua_rawseti(L, -2, i+1);
-                }
-            } break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
-            {
-                for (int i=0;i<fieldsize;i++)
-                {
-                    lua_pushnumber(L, pReflection->GetRepeatedFloat(*pMsg, field, i));
-                    lua_rawseti(L, -2, i+1);
-                }
-            } break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
-            {
-                for (int i=0;i<fieldsize;i++)
-                {
-                    lua_pushboolean(L, pReflection->GetRepeatedBool(*pMsg, field, i));
-                    lua_rawseti(L, -2, i+1);
-                }
-            } break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
-            {
-                for (int i=0;i<fieldsize;i++)
-                {
-                    auto valuetype = pReflection->GetRepeatedEnum(*pMsg, field, i);
-                    valuetype ? lua_pushstring(L, valuetype->name().c_str()) : lua_pushliteral(L, "error enum");
-                    lua_rawseti(L, -2, i+1);
-                }
-            } break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_STRING:
-            {
-                for (int i=0;i<fieldsize;i++)
-                {
-                    std::string str;
-                    str = pReflection->GetRepeatedStringReference(*pMsg, field, i, &str);
-                    lua_pushlstring(L, str.c_str(), str.length());
-                    lua_rawseti(L, -2, i+1);
-                }
-            } break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE:
+            pState->arenabusy = true;
+            return pMessage->New(pState->arena.get());
+        }
+
+        if (pState->poolsize > 0)
+        {
+            std::vector<std::unique_ptr<google::protobuf::Message>>& list = pState->pool[pMessage->GetDescriptor()];
+            if (!list.empty())
             {
-                for (int i=0;i<fieldsize;i++)
-                {
-                    auto &msg = pReflection->GetRepeatedMessage(*pMsg, field, i);
-                    _msg2table(L, &msg);
-                    lua_rawseti(L, -2, i+1);
-                }
-            } break;
-            default: break;
+                google::protobuf::Message* msg = list.back().release();
+                list.pop_back();
+                pState->poolhit++;
+                return msg;
+            }
+            pState->poolmiss++;
         }
+
+        if (pState->stats) pState->typestats[pMessage->GetDescriptor()].allocs++;
+        return pMessage->New();
     }
 
-    static void _msg2kv(lua_State *L, const google::protobuf::Message* pMsg)
+    static MessagePtr _holdmsg(lua_State *L, google::protobuf::Message* msg)
     {
-        std::vector<const google::protobuf::FieldDescriptor*> fields;
-        const google::protobuf::Message::Reflection* pReflection;
-        const google::protobuf::FieldDescriptor* pField;
-        const google::protobuf::Descriptor* pDesc;
+        MessageRelease release = {_getstate(L)};
+        return MessagePtr(msg, release);
+    }
 
- 		pReflection = pMsg->GetReflection();
-		if (pReflection == nullptr) luaL_error(L, "GetReflection Failed!");
+    // size == 0 turns the arena off, otherwise size bytes stay allocated for it between calls
+    static void _setarena(lua_State *L, CodecState* pState, size_t size)
+    {
+        google::protobuf::ArenaOptions options;
 
-        pDesc = pMsg->GetDescriptor();
-		if (pDesc == nullptr) luaL_error(L, "GetDescriptor Failed!");
-      
-        pReflection->ListFields(*pMsg, &fields);
-        if (fields.size() != 2) luaL_error(L, "msg2kv size error!");
+        if (pState->arenabusy) luaL_error(L, "arena is in use!");
 
-        pField = pDesc->FindFieldByName("key");
-        if (pField == nullptr) luaL_error(L, "no key field!");
-        _pushfield(L, pMsg, pReflection, pField);
+        pState->arena.reset();
+        pState->arenablock.reset();
+        pState->arenasize = size;
+        if (size == 0) return;
 
-        pField = pDesc->FindFieldByName("value");
-        if (pField == nullptr) luaL_error(L, "no value field!");
-        _pushfield(L, pMsg, pReflection, pField);
+        pState->arenablock.reset(new char[size]);
+        options.initial_block = pState->arenablock.get();
+        options.initial_block_size = size;
+        pState->arena.reset(new google::protobuf::Arena(options));
     }
 
-    static void _pushmap(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const google::protobuf::FieldDescriptor *field)
+    static void _setpool(CodecState* pState, size_t size)
     {
-        if (field->cpp_type() != google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE)
-            luaL_error(L, "map cpptype must be message!");
-        
-        auto fieldsize = pReflection->FieldSize(*pMsg, field);
-        lua_createtable(L, 0, fieldsize);
-        for (int i=0;i<fieldsize;i++)
+        pState->poolsize = size;
+        for (auto& it : pState->pool)
         {
-            auto &msg = pReflection->GetRepeatedMessage(*pMsg, field, i);
-            _msg2kv(L, &msg);
-            lua_rawset(L, -3);
+            if (it.second.size() > size) it.second.resize(size);
         }
     }
 
-    static void _pushfield(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const google::protobuf::FieldDescriptor *field)
+    // contiguous storage of a repeated scalar field, one reflection call instead of one per element
+    // GetRepeatedFieldRef has no bulk access, so this stays on the older (deprecated) accessors
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#endif
+    template <typename T>
+    static const google::protobuf::RepeatedField<T>& _repeated(const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const google::protobuf::FieldDescriptor* field)
+    {
+        return pReflection->GetRepeatedField<T>(*pMsg, field);
+    }
+
+    template <typename T>
+    static google::protobuf::RepeatedField<T>* _mutablerepeated(google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const google::protobuf::FieldDescriptor* field)
+    {
+        return pReflection->MutableRepeatedField<T>(pMsg, field);
+    }
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+    static size_t _elemsize(google::protobuf::FieldDescriptor::CppType type)
     {
-        switch (field->label())
+        switch (type)
         {
-            case google::protobuf::FieldDescriptor::LABEL_OPTIONAL:
-            case google::protobuf::FieldDescriptor::LABEL_REQUIRED: _pushsingle(L, pMsg, pReflection, field); break;
-            case google::protobuf::FieldDescriptor::LABEL_REPEATED: field->is_map() ? _pushmap(L, pMsg, pReflection, field) : _pusharray(L, pMsg, pReflection, field); break;
-            default: lua_pushnil(L); break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+            case google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+            case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT: return 4;
+            case google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+            case google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+            case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE: return 8;
+            default: return 0;
         }
     }
 
-    static void _msg2table(lua_State *L, const google::protobuf::Message* pMsg)
+    static void* _arraydata(TypedArray* pArray)
     {
-        std::vector<const google::protobuf::FieldDescriptor*> fields;
-        const google::protobuf::Message::Reflection* pReflection;
+        return pArray + 1;
+    }
 
- 		pReflection = pMsg->GetReflection();
-		if (pReflection == nullptr) luaL_error(L, "GetReflection Failed!");
-       
-        pReflection->ListFields(*pMsg, &fields);
-        lua_createtable(L, 0, fields.size());
+    // new zeroed typed array => top
+    static TypedArray* _newarray(lua_State *L, google::protobuf::FieldDescriptor::CppType type, size_t count)
+    {
+        size_t size = _elemsize(type) * count;
+        TypedArray* pArray = (TypedArray*)lua_newuserdata(L, sizeof(TypedArray) + size);
+
+        pArray->type = type;
+        pArray->count = count;
+        memset(_arraydata(pArray), 0, size);
+        lua_pushvalue(L, lua_upvalueindex(9));
+        lua_setmetatable(L, -2);
+        return pArray;
+    }
+
+    static TypedArray* _toarray(lua_State *L, int idx)
+    {
+        TypedArray* pArray = (TypedArray*)lua_touserdata(L, idx);
+        bool ok;
+
+        if (pArray == nullptr || !lua_getmetatable(L, idx)) return nullptr;
+        ok = lua_rawequal(L, -1, lua_upvalueindex(9));
+        lua_pop(L, 1);
+        return ok ? pArray : nullptr;
+    }
+
+    // element i (0 based) converted to T
+    template <typename T>
+    static T _arrayat(TypedArray* pArray, size_t i)
+    {
+        void* data = _arraydata(pArray);
 
-        for (auto field : fields)
+        switch (pArray->type)
         {
-            lua_pushstring(L, field->name().c_str());
-            _pushfield(L, pMsg, pReflection, field);
-            lua_rawset(L, -3);
+            case google::protobuf::FieldDescriptor::CPPTYPE_INT32: return (T)((google::protobuf::int32*)data)[i];
+            case google::protobuf::FieldDescriptor::CPPTYPE_UINT32: return (T)((google::protobuf::uint32*)data)[i];
+            case google::protobuf::FieldDescriptor::CPPTYPE_INT64: return (T)((google::protobuf::int64*)data)[i];
+            case google::protobuf::FieldDescriptor::CPPTYPE_UINT64: return (T)((google::protobuf::uint64*)data)[i];
+            case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT: return (T)((float*)data)[i];
+            case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE: return (T)((double*)data)[i];
+            default: return T();
         }
     }
 
-    static void _setsingle(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const google::protobuf::FieldDescriptor *field)
+    // element i (0 based) => top
+    static void _pusharrayat(lua_State *L, TypedArray* pArray, size_t i)
     {
-		switch (field->cpp_type())
-		{
-			case google::protobuf::FieldDescriptor::CPPTYPE_INT32:
-            {
-                auto value = luaL_checkinteger(L, -1);
-                pReflection->SetInt32(pMsg, field, value);
-            } break;
-			case google::protobuf::FieldDescriptor::CPPTYPE_INT64:
-            {
-                auto value = luaL_checkinteger(L, -1);
-                pReflection->SetInt64(pMsg, field, value);
-            } break;
-			case google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
-            {
-                auto value = luaL_checkinteger(L, -1);
-                pReflection->SetUInt32(pMsg, field, value);
-            } break;
-			case google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
-            {
-                auto value = luaL_checkinteger(L, -1);
-                pReflection->SetUInt64(pMsg, field, value);
-            } break;
-			case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
-            {
-                auto value = luaL_checknumber(L, -1);
-                pReflection->SetDouble(pMsg, field, value);
-            } break;
-			case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
-            {
-                auto value = luaL_checknumber(L, -1);
-                pReflection->SetFloat(pMsg, field, value);
-            } break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
-            {
-                auto value = lua_toboolean(L, -1);
-                pReflection->SetBool(pMsg, field, value);
-            } break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
-            {
-                const char* value = luaL_checkstring(L, -1);
-                const google::protobuf::EnumValueDescriptor *enumvalue = nullptr;
-                auto enumtype = field->enum_type();
-                if (enumtype) enumvalue = enumtype->FindValueByName(value);
-                if (enumvalue) pReflection->SetEnum(pMsg, field, enumvalue);
-            } break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_STRING:
-            {
-                const char* value = luaL_checkstring(L, -1);
-                pReflection->SetString(pMsg, field, value);
-            } break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE:
-            {
-                auto pSubMsg = pReflection->MutableMessage(pMsg, field);
-                _table2msg(L, pSubMsg);
-            } break;
-            default: break;
-        }
+        if (pArray->type == google::protobuf::FieldDescriptor::CPPTYPE_FLOAT || pArray->type == google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE)
+            lua_pushnumber(L, _arrayat<double>(pArray, i));
+        else if (pArray->type == google::protobuf::FieldDescriptor::CPPTYPE_UINT64)
+            lua_pushinteger(L, (lua_Integer)_arrayat<google::protobuf::uint64>(pArray, i));
+        else
+            lua_pushinteger(L, _arrayat<google::protobuf::int64>(pArray, i));
     }
 
-    static void _setarray(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const google::protobuf::FieldDescriptor *field)
+    // repeated field values => typed array at top when option("typedarray") asks for it
+    template <typename T>
+    static bool _pushtyped(lua_State *L, const FieldPlan* plan, const T* p, size_t count)
     {
-        size_t len;
-        if (!lua_istable(L, -1)) return;
-        len = lua_rawlen(L, -1);
+        CodecState* pState = _getstate(L);
 
-		switch (field->cpp_type())
-		{
-			case google::protobuf::FieldDescriptor::CPPTYPE_INT32:
-            {
-                for (int i=1; i<=len; i++)
-                {
-                    lua_rawgeti(L, -1, i);
-                    auto value = luaL_checkinteger(L, -1);
-                    pReflection->AddInt32(pMsg, field, value);
-                    lua_pop(L, 1);
-                }
-            } break;
-			case google::protobuf::FieldDescriptor::CPPTYPE_INT64:
-            {
-                for (int i=1; i<=len; i++)
-                {
-                    lua_rawgeti(L, -1, i);
-                    auto value = luaL_checkinteger(L, -1);
-                    pReflection->AddInt64(pMsg, field, value);
-                    lua_pop(L, 1);
-                }
-            } break;
-			case google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
-            {
-                for (int i=1; i<=len; i++)
-                {
-                    lua_rawgeti(L, -1, i);
-                    auto value = luaL_checkinteger(L, -1);
-                    pReflection->AddUInt32(pMsg, field, value);
-                    lua_pop(L, 1);
-                }
-            } break;
-			case google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
-            {
-                for (int i=1; i<=len; i++)
-                {
-                    lua_rawgeti(L, -1, i);
-                    auto value = luaL_checkinteger(L, -1);
-                    pReflection->AddUInt64(pMsg, field, value);
-                    lua_pop(L, 1);
-                }
-            } break;
-			case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
-            {
-                for (int i=1; i<=len; i++)
-                {
-                    lua_rawgeti(L, -1, i);
-                    auto value = luaL_checknumber(L, -1);
-                    pReflection->AddDouble(pMsg, field, value);
-                    lua_pop(L, 1);
-                }
-            } break;
-			case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
-            {
-                for (int i=1; i<=len; i++)
-                {
-                    lua_rawgeti(L, -1, i);
-                    auto value = luaL_checknumber(L, -1);
-                    pReflection->AddFloat(pMsg, field, value);
-                    lua_pop(L, 1);
-                }
-            } break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
-            {
-                for (int i=1; i<=len; i++)
-                {
-                    lua_rawgeti(L, -1, i);
-                    auto value = lua_toboolean(L, -1);
-                    pReflection->AddBool(pMsg, field, value);
-                    lua_pop(L, 1);
-                }
-            } break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
-            {
-                for (int i=1; i<=len; i++)
-                {
-                    lua_rawgeti(L, -1, i);
-                    const char* value = luaL_checkstring(L, -1);
-                    const google::protobuf::EnumValueDescriptor *enumvalue = nullptr;
-                    auto enumtype = field->enum_type();
-                    if (enumtype) enumvalue = enumtype->FindValueByName(value);
-                    if (enumvalue) pReflection->AddEnum(pMsg, field, enumvalue);
-                    else luaL_error(L, "Invalid Enum In Repeated Field! %s", value);
-                    lua_pop(L, 1);
-                }
-            } break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_STRING:
-            {
-                for (int i=1; i<=len; i++)
-                {
-                    lua_rawgeti(L, -1, i);
-                    const char* value = luaL_checkstring(L, -1);
-                    pReflection->AddString(pMsg, field, value);
-                    lua_pop(L, 1);
-                }
-            } break;
-            case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE:
-            {
-                for (int i=1; i<=len; i++)
-                {
-                    lua_rawgeti(L, -1, i);
-                    auto pSubMsg = pReflection->AddMessage(pMsg, field);
-                    _table2msg(L, pSubMsg);
-                    lua_pop(L, 1);
-                }
-            } break;
-            default: break;
+        if (pState->typedarray == 0 || count < pState->typedarray) return false;
+        TypedArray* pArray = _newarray(L, plan->field->cpp_type(), count);
+        memcpy(_arraydata(pArray), p, count * sizeof(T));
+        return true;
+    }
+
+    // typed array at top => appended to the repeated field, a memcpy when the element types match
+    template <typename T>
+    static bool _settyped(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        TypedArray* pArray = _toarray(L, -1);
+        if (pArray == nullptr) return false;
+
+        auto values = _mutablerepeated<T>(pMsg, pReflection, plan->field);
+        int size = values->size();
+        values->Resize(size + (int)pArray->count, T());
+        if (pArray->type == plan->field->cpp_type())
+        {
+            memcpy(values->mutable_data() + size, _arraydata(pArray), pArray->count * sizeof(T));
+            return true;
         }
+        for (size_t i=0; i<pArray->count; i++) values->Set(size + (int)i, _arrayat<T>(pArray, i));
+        return true;
     }
 
-    static void _kv2msg(lua_State *L, google::protobuf::Message* pMsg)
+    template <typename T, T (google::protobuf::Message::Reflection::*Get)(const google::protobuf::Message&, const google::protobuf::FieldDescriptor*) const>
+    static void _pushinteger(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
     {
-        const google::protobuf::Descriptor* pDesc;
-        const google::protobuf::Message::Reflection* pReflection;
-        const google::protobuf::FieldDescriptor* pKeyField, *pValueField;
+        lua_pushinteger(L, (pReflection->*Get)(*pMsg, plan->field));
+    }
 
- 		pReflection = pMsg->GetReflection();
-		if (pReflection == nullptr) luaL_error(L, "GetReflection Failed!");
+    template <typename T, T (google::protobuf::Message::Reflection::*Get)(const google::protobuf::Message&, const google::protobuf::FieldDescriptor*) const>
+    static void _pushnumber(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        lua_pushnumber(L, (pReflection->*Get)(*pMsg, plan->field));
+    }
+
+    static void _pushbool(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        lua_pushboolean(L, pReflection->GetBool(*pMsg, plan->field));
+    }
+
+    // enum type => table at top, number => interned name and name => EnumValueDescriptor lightuserdata
+    // kept next to the interned field names, keyed by the EnumDescriptor
+    static void _pushenumtable(lua_State *L, const google::protobuf::EnumDescriptor* pEnum)
+    {
+        if (lua_rawgetp(L, lua_upvalueindex(5), pEnum) != LUA_TNIL) return;
+        lua_pop(L, 1);
+
+        lua_createtable(L, 0, pEnum->value_count() * 2);
+        for (int i=pEnum->value_count()-1; i>=0; i--)   //backwards, so an alias number maps to the first name like FindValueByNumber
+        {
+            auto value = pEnum->value(i);
+            lua_pushlstring(L, value->name().c_str(), value->name().length());
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, -3, value->number());
+            lua_pushlightuserdata(L, (void*)value);
+            lua_rawset(L, -3);
+        }
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, lua_upvalueindex(5), pEnum);
+    }
+
+    // enum value => its name, or the number in option("enum", "number") mode and for values unknown to the schema
+    static void _pushenumvalue(lua_State *L, const google::protobuf::EnumDescriptor* pEnum, int number)
+    {
+        if (_getstate(L)->enumnumber)
+        {
+            lua_pushinteger(L, number);
+            return;
+        }
+        _pushenumtable(L, pEnum);
+        if (lua_rawgeti(L, -1, number) == LUA_TNIL)
+        {
+            lua_pop(L, 1);
+            lua_pushinteger(L, number);
+        }
+        lua_remove(L, -2);
+    }
+
+    // enum name or number at idx => value descriptor, nullptr when the schema has no such value
+    static const google::protobuf::EnumValueDescriptor* _checkenum(lua_State *L, int idx, const google::protobuf::EnumDescriptor* pEnum)
+    {
+        const google::protobuf::EnumValueDescriptor* pValue;
+
+        if (lua_type(L, idx) == LUA_TNUMBER) return pEnum->FindValueByNumber((int)luaL_checkinteger(L, idx));
+
+        luaL_checkstring(L, idx);
+        idx = lua_absindex(L, idx);
+        _pushenumtable(L, pEnum);
+        lua_pushvalue(L, idx);
+        lua_rawget(L, -2);
+        pValue = (const google::protobuf::EnumValueDescriptor*)lua_touserdata(L, -1);
+        lua_pop(L, 2);
+        return pValue;
+    }
+
+    // proto3 enums are open: a number _checkenum has no value for is still kept, as decode hands it out
+    static bool _openenum(lua_State *L, int idx, const google::protobuf::FieldDescriptor* field, int* number)
+    {
+        lua_Integer value;
+
+        if (field->file()->syntax() != google::protobuf::FileDescriptor::SYNTAX_PROTO3 || !lua_isinteger(L, idx)) return false;
+        value = lua_tointeger(L, idx);
+        if (value < INT_MIN || value > INT_MAX) return false;
+        *number = (int)value;
+        return true;
+    }
+
+    static void _pushenum(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        auto valuetype = pReflection->GetEnum(*pMsg, plan->field);
+        if (valuetype) _pushenumvalue(L, plan->field->enum_type(), valuetype->number());
+        else lua_pushnil(L);
+    }
+
+    // long bytes become a {lightuserdata, length} view over the message while a deserialize callback runs
+    template <bool Bytes>
+    static void _pushbytes(lua_State *L, const std::string& str)
+    {
+        CodecState* pState;
+
+        if (Bytes)
+        {
+            pState = _getstate(L);
+            if (pState->viewing && str.length() >= pState->bytesview)
+            {
+                lua_createtable(L, 2, 0);
+                lua_pushlightuserdata(L, (void*)str.data());
+                lua_rawseti(L, -2, 1);
+                lua_pushinteger(L, str.length());
+                lua_rawseti(L, -2, 2);
+                return;
+            }
+        }
+        lua_pushlstring(L, str.data(), str.length());
+    }
+
+    template <bool Bytes>
+    static void _pushstring(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        std::string scratch;
+        const std::string& str = pReflection->GetStringReference(*pMsg, plan->field, &scratch);
+        _pushbytes<Bytes>(L, str);
+    }
+
+    // table at idx is taken by the _newtable of the push handler called right after
+    static void _offertable(lua_State *L, int idx)
+    {
+        CodecState* pState = _getstate(L);
+        pState->reuse = idx;
+        pState->reusetop = lua_gettop(L);
+    }
+
+    // every top level conversion starts with nothing on offer, a call that raised may have left one behind
+    static void _dropoffer(lua_State *L)
+    {
+        _getstate(L)->reuse = 0;
+    }
+
+    // table for a message or repeated value => top, true when it is an old table offered by deserialize_into
+    static bool _newtable(lua_State *L, int narr, int nrec)
+    {
+        CodecState* pState = _getstate(L);
+        if (pState->reuse && pState->reusetop == lua_gettop(L))
+        {
+            lua_pushvalue(L, pState->reuse);
+            pState->reuse = 0;
+            return true;
+        }
+        lua_createtable(L, narr, nrec);
+        return false;
+    }
+
+    static void _pushmessage(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        auto &msg = pReflection->GetMessage(*pMsg, plan->field);
+        _msg2table(L, &msg);
+    }
+
+    template <typename T>
+    static void _pushintegers(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        auto &values = _repeated<T>(pMsg, pReflection, plan->field);
+        const T* p = values.data();
+        int fieldsize = values.size();
+        if (_pushtyped<T>(L, plan, p, fieldsize)) return;
+        _newtable(L, fieldsize, 0);
+        for (int i=0;i<fieldsize;i++)
+        {
+            lua_pushinteger(L, (lua_Integer)p[i]);
+            lua_rawseti(L, -2, i+1);
+        }
+    }
+
+    template <typename T>
+    static void _pushnumbers(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        auto &values = _repeated<T>(pMsg, pReflection, plan->field);
+        const T* p = values.data();
+        int fieldsize = values.size();
+        if (_pushtyped<T>(L, plan, p, fieldsize)) return;
+        _newtable(L, fieldsize, 0);
+        for (int i=0;i<fieldsize;i++)
+        {
+            lua_pushnumber(L, p[i]);
+            lua_rawseti(L, -2, i+1);
+        }
+    }
+
+    static void _pushbools(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        auto &values = _repeated<bool>(pMsg, pReflection, plan->field);
+        const bool* p = values.data();
+        int fieldsize = values.size();
+        _newtable(L, fieldsize, 0);
+        for (int i=0;i<fieldsize;i++)
+        {
+            lua_pushboolean(L, p[i]);
+            lua_rawseti(L, -2, i+1);
+        }
+    }
+
+    static void _pushenums(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        auto fieldsize = pReflection->FieldSize(*pMsg, plan->field);
+        _newtable(L, fieldsize, 0);
+        for (int i=0;i<fieldsize;i++)
+        {
+            auto valuetype = pReflection->GetRepeatedEnum(*pMsg, plan->field, i);
+            if (valuetype) _pushenumvalue(L, plan->field->enum_type(), valuetype->number());
+            else lua_pushliteral(L, "error enum");
+            lua_rawseti(L, -2, i+1);
+        }
+    }
+
+    template <bool Bytes>
+    static void _pushstrings(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        auto fieldsize = pReflection->FieldSize(*pMsg, plan->field);
+        _newtable(L, fieldsize, 0);
+        for (int i=0;i<fieldsize;i++)
+        {
+            std::string scratch;
+            const std::string& str = pReflection->GetRepeatedStringReference(*pMsg, plan->field, i, &scratch);
+            _pushbytes<Bytes>(L, str);
+            lua_rawseti(L, -2, i+1);
+        }
+    }
+
+    static void _pushmessages(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        auto fieldsize = pReflection->FieldSize(*pMsg, plan->field);
+        bool reused = _newtable(L, fieldsize, 0);
+        for (int i=0;i<fieldsize;i++)
+        {
+            auto &msg = pReflection->GetRepeatedMessage(*pMsg, plan->field, i);
+            if (reused)
+            {
+                if (lua_rawgeti(L, -1, i+1) == LUA_TTABLE) _offertable(L, lua_gettop(L));
+                _msg2table(L, &msg);
+                _getstate(L)->reuse = 0;
+                lua_remove(L, -2);
+            }
+            else _msg2table(L, &msg);
+            lua_rawseti(L, -2, i+1);
+        }
+    }
+
+    // map field => key and value plans of its entry, resolved by field number like the wire format does
+    static void _entryplans(const FieldPlan* plan, const FieldPlan** kplan, const FieldPlan** vplan)
+    {
+        *kplan = &plan->sub->fields[0];
+        *vplan = &plan->sub->fields[1];
+        if ((*kplan)->number != 1) std::swap(*kplan, *vplan);
+    }
+
+    static void _pushmap(lua_State *L, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        const google::protobuf::Message::Reflection* pEntryReflection = nullptr;
+        const FieldPlan* kplan, *vplan;
+
+        auto fieldsize = pReflection->FieldSize(*pMsg, plan->field);
+        _entryplans(plan, &kplan, &vplan);
+        _newtable(L, 0, fieldsize);
+        for (int i=0;i<fieldsize;i++)
+        {
+            auto &msg = pReflection->GetRepeatedMessage(*pMsg, plan->field, i);
+            if (pEntryReflection == nullptr) pEntryReflection = msg.GetReflection();     //entries share one type
+            kplan->push(L, &msg, pEntryReflection, kplan);
+            vplan->push(L, &msg, pEntryReflection, vplan);
+            lua_rawset(L, -3);
+        }
+    }
+
+    template <typename T, void (google::protobuf::Message::Reflection::*Set)(google::protobuf::Message*, const google::protobuf::FieldDescriptor*, T) const>
+    static void _setinteger(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        auto value = luaL_checkinteger(L, -1);
+        (pReflection->*Set)(pMsg, plan->field, value);
+    }
+
+    template <typename T, void (google::protobuf::Message::Reflection::*Set)(google::protobuf::Message*, const google::protobuf::FieldDescriptor*, T) const>
+    static void _setnumber(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        auto value = luaL_checknumber(L, -1);
+        (pReflection->*Set)(pMsg, plan->field, value);
+    }
+
+    static void _setbool(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        auto value = lua_toboolean(L, -1);
+        pReflection->SetBool(pMsg, plan->field, value);
+    }
+
+    static void _setenum(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        auto enumvalue = _checkenum(L, -1, plan->field->enum_type());
+        int number;
+        if (enumvalue) pReflection->SetEnum(pMsg, plan->field, enumvalue);
+        else if (_openenum(L, -1, plan->field, &number)) pReflection->SetEnumValue(pMsg, plan->field, number);
+    }
+
+    static void _setstring(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        size_t len;
+        const char* value = luaL_checklstring(L, -1, &len);
+        pReflection->SetString(pMsg, plan->field, std::string(value, len));
+    }
+
+    static void _setmessage(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        auto pSubMsg = pReflection->MutableMessage(pMsg, plan->field);
+        _table2msg(L, pSubMsg);
+    }
+
+    template <typename T>
+    static void _setintegers(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        size_t len;
+        if (_settyped<T>(L, pMsg, pReflection, plan)) return;
+        if (!lua_istable(L, -1)) return;
+        len = lua_rawlen(L, -1);
+
+        auto values = _mutablerepeated<T>(pMsg, pReflection, plan->field);
+        values->Reserve(values->size() + len);
+        for (size_t i=1; i<=len; i++)
+        {
+            lua_rawgeti(L, -1, i);
+            values->AddAlreadyReserved((T)luaL_checkinteger(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+
+    template <typename T>
+    static void _setnumbers(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        size_t len;
+        if (_settyped<T>(L, pMsg, pReflection, plan)) return;
+        if (!lua_istable(L, -1)) return;
+        len = lua_rawlen(L, -1);
+
+        auto values = _mutablerepeated<T>(pMsg, pReflection, plan->field);
+        values->Reserve(values->size() + len);
+        for (size_t i=1; i<=len; i++)
+        {
+            lua_rawgeti(L, -1, i);
+            values->AddAlreadyReserved((T)luaL_checknumber(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+
+    static void _setbools(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        size_t len;
+        if (!lua_istable(L, -1)) return;
+        len = lua_rawlen(L, -1);
+
+        auto values = _mutablerepeated<bool>(pMsg, pReflection, plan->field);
+        values->Reserve(values->size() + len);
+        for (size_t i=1; i<=len; i++)
+        {
+            lua_rawgeti(L, -1, i);
+            values->AddAlreadyReserved(lua_toboolean(L, -1) != 0);
+            lua_pop(L, 1);
+        }
+    }
+
+    static void _setenums(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        size_t len;
+        if (!lua_istable(L, -1)) return;
+        len = lua_rawlen(L, -1);
+
+        auto enumtype = plan->field->enum_type();
+        for (size_t i=1; i<=len; i++)
+        {
+            lua_rawgeti(L, -1, i);
+            auto enumvalue = _checkenum(L, -1, enumtype);
+            int number;
+            if (enumvalue) pReflection->AddEnum(pMsg, plan->field, enumvalue);
+            else if (_openenum(L, -1, plan->field, &number)) pReflection->AddEnumValue(pMsg, plan->field, number);
+            else luaL_error(L, "Invalid Enum In Repeated Field! %s", lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+    }
+
+    static void _setstrings(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        size_t len;
+        if (!lua_istable(L, -1)) return;
+        len = lua_rawlen(L, -1);
+
+        for (size_t i=1; i<=len; i++)
+        {
+            size_t size;
+            lua_rawgeti(L, -1, i);
+            const char* value = luaL_checklstring(L, -1, &size);
+            pReflection->AddString(pMsg, plan->field, std::string(value, size));
+            lua_pop(L, 1);
+        }
+    }
+
+    static void _setmessages(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        size_t len;
+        if (!lua_istable(L, -1)) return;
+        len = lua_rawlen(L, -1);
+
+        for (size_t i=1; i<=len; i++)
+        {
+            lua_rawgeti(L, -1, i);
+            auto pSubMsg = pReflection->AddMessage(pMsg, plan->field);
+            _table2msg(L, pSubMsg);
+            lua_pop(L, 1);
+        }
+    }
+
+    static void _setmap(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        const google::protobuf::Message::Reflection* pEntryReflection = nullptr;
+        const FieldPlan* kplan, *vplan;
+
+        if (!lua_istable(L, -1)) return;
+
+        _entryplans(plan, &kplan, &vplan);
+        lua_pushnil(L);
+        while (lua_next(L, -2) != 0)
+        {
+            auto pSubMsg = pReflection->AddMessage(pMsg, plan->field);
+            if (pEntryReflection == nullptr) pEntryReflection = pSubMsg->GetReflection();
+            lua_pushvalue(L, -2);                       //key, value, key
+            kplan->set(L, pSubMsg, pEntryReflection, kplan);
+            lua_pop(L, 1);
+            vplan->set(L, pSubMsg, pEntryReflection, vplan);
+            lua_pop(L, 1);
+        }
+    }
+
+    template <typename T, google::protobuf::internal::WireFormatLite::FieldType F>
+    static bool _decodeinteger(lua_State *L, google::protobuf::io::CodedInputStream* input, const FieldPlan* plan)
+    {
+        T value;
+        if (!google::protobuf::internal::WireFormatLite::ReadPrimitive<T, F>(input, &value)) return false;
+        if (plan->nopresence && value == 0) lua_pushnil(L);
+        else lua_pushinteger(L, value);
+        return true;
+    }
+
+    template <typename T, google::protobuf::internal::WireFormatLite::FieldType F>
+    static bool _decodenumber(lua_State *L, google::protobuf::io::CodedInputStream* input, const FieldPlan* plan)
+    {
+        T value;
+        if (!google::protobuf::internal::WireFormatLite::ReadPrimitive<T, F>(input, &value)) return false;
+        if (plan->nopresence && value == 0 && !std::signbit(value)) lua_pushnil(L);
+        else lua_pushnumber(L, value);
+        return true;
+    }
+
+    static bool _decodebool(lua_State *L, google::protobuf::io::CodedInputStream* input, const FieldPlan* plan)
+    {
+        bool value;
+        if (!google::protobuf::internal::WireFormatLite::ReadPrimitive<bool, google::protobuf::internal::WireFormatLite::TYPE_BOOL>(input, &value)) return false;
+        if (plan->nopresence && !value) lua_pushnil(L);
+        else lua_pushboolean(L, value);
+        return true;
+    }
+
+    static bool _decodeenum(lua_State *L, google::protobuf::io::CodedInputStream* input, const FieldPlan* plan)
+    {
+        int value;
+        if (!google::protobuf::internal::WireFormatLite::ReadPrimitive<int, google::protobuf::internal::WireFormatLite::TYPE_ENUM>(input, &value)) return false;
+        if (plan->nopresence && value == 0) { lua_pushnil(L); return true; }
+        if (plan->field->file()->syntax() != google::protobuf::FileDescriptor::SYNTAX_PROTO3 && plan->field->enum_type()->FindValueByNumber(value) == nullptr)
+            lua_pushnil(L);                             //proto2 keeps unknown enum values out of the message
+        else _pushenumvalue(L, plan->field->enum_type(), value);
+        return true;
+    }
+
+    // length prefix of a delimited field, false when it is longer than any input the decoders take
+    static bool _readlength(google::protobuf::io::CodedInputStream* input, google::protobuf::uint32* length)
+    {
+        return input->ReadVarint32(length) && *length <= (google::protobuf::uint32)INT_MAX;
+    }
+
+    // the decoders read from memory, so a length running past the buffer is malformed
+    static bool _viewlength(google::protobuf::io::CodedInputStream* input, google::protobuf::uint32 length, const void** data)
+    {
+        int size;
+
+        if (length == 0)
+        {
+            *data = "";
+            return true;
+        }
+        return input->GetDirectBufferPointer(data, &size) && size >= 0 && (size_t)size >= length;
+    }
+
+    static bool _decodestring(lua_State *L, google::protobuf::io::CodedInputStream* input, const FieldPlan* plan)
+    {
+        google::protobuf::uint32 length;
+        const void* data;
+        if (!_readlength(input, &length) || !_viewlength(input, length, &data)) return false;
+        if (plan->utf8 && !google::protobuf::internal::IsStructurallyValidUTF8((const char*)data, (int)length)) return false;
+        if (plan->nopresence && length == 0) lua_pushnil(L);
+        else lua_pushlstring(L, (const char*)data, length);
+        return input->Skip(length);
+    }
+
+    static const MessagePlan* _compileplan(PlanRegistry* pRegistry, const google::protobuf::Descriptor* pDescriptor);
+
+    // compiling touches no lua_State, so an error can never jump out while the registry is locked
+    static void _compilefield(PlanRegistry* pRegistry, FieldPlan* plan, const google::protobuf::FieldDescriptor* field)
+    {
+        typedef google::protobuf::Message::Reflection R;
+
+        typedef google::protobuf::internal::WireFormatLite W;
+
+        plan->field = field;
+        plan->number = field->number();
+        plan->wiretype = google::protobuf::internal::WireFormat::WireTypeForField(field);
+        plan->utf8 = field->type() == google::protobuf::FieldDescriptor::TYPE_STRING && field->file()->syntax() == google::protobuf::FileDescriptor::SYNTAX_PROTO3;
+        plan->nopresence = field->file()->syntax() == google::protobuf::FileDescriptor::SYNTAX_PROTO3 && !field->is_repeated()
+            && field->cpp_type() != google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE && field->containing_oneof() == nullptr;
+        plan->sub = field->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE ? _compileplan(pRegistry, field->message_type()) : nullptr;
+
+        switch (field->type())
+        {
+            case google::protobuf::FieldDescriptor::TYPE_INT32: plan->decode = _decodeinteger<google::protobuf::int32, W::TYPE_INT32>; break;
+            case google::protobuf::FieldDescriptor::TYPE_INT64: plan->decode = _decodeinteger<google::protobuf::int64, W::TYPE_INT64>; break;
+            case google::protobuf::FieldDescriptor::TYPE_UINT32: plan->decode = _decodeinteger<google::protobuf::uint32, W::TYPE_UINT32>; break;
+            case google::protobuf::FieldDescriptor::TYPE_UINT64: plan->decode = _decodeinteger<google::protobuf::uint64, W::TYPE_UINT64>; break;
+            case google::protobuf::FieldDescriptor::TYPE_SINT32: plan->decode = _decodeinteger<google::protobuf::int32, W::TYPE_SINT32>; break;
+            case google::protobuf::FieldDescriptor::TYPE_SINT64: plan->decode = _decodeinteger<google::protobuf::int64, W::TYPE_SINT64>; break;
+            case google::protobuf::FieldDescriptor::TYPE_FIXED32: plan->decode = _decodeinteger<google::protobuf::uint32, W::TYPE_FIXED32>; break;
+            case google::protobuf::FieldDescriptor::TYPE_FIXED64: plan->decode = _decodeinteger<google::protobuf::uint64, W::TYPE_FIXED64>; break;
+            case google::protobuf::FieldDescriptor::TYPE_SFIXED32: plan->decode = _decodeinteger<google::protobuf::int32, W::TYPE_SFIXED32>; break;
+            case google::protobuf::FieldDescriptor::TYPE_SFIXED64: plan->decode = _decodeinteger<google::protobuf::int64, W::TYPE_SFIXED64>; break;
+            case google::protobuf::FieldDescriptor::TYPE_DOUBLE: plan->decode = _decodenumber<double, W::TYPE_DOUBLE>; break;
+            case google::protobuf::FieldDescriptor::TYPE_FLOAT: plan->decode = _decodenumber<float, W::TYPE_FLOAT>; break;
+            case google::protobuf::FieldDescriptor::TYPE_BOOL: plan->decode = _decodebool; break;
+            case google::protobuf::FieldDescriptor::TYPE_ENUM: plan->decode = _decodeenum; break;
+            case google::protobuf::FieldDescriptor::TYPE_STRING:
+            case google::protobuf::FieldDescriptor::TYPE_BYTES: plan->decode = _decodestring; break;
+            default: plan->decode = nullptr; break;
+        }
+
+        if (field->is_map())                               //map fields are always repeated entry messages
+        {
+            plan->push = _pushmap;
+            plan->set = _setmap;
+        }
+        else if (field->is_repeated())
+        {
+            switch (field->cpp_type())
+            {
+                case google::protobuf::FieldDescriptor::CPPTYPE_INT32: plan->push = _pushintegers<google::protobuf::int32>; plan->set = _setintegers<google::protobuf::int32>; break;
+                case google::protobuf::FieldDescriptor::CPPTYPE_INT64: plan->push = _pushintegers<google::protobuf::int64>; plan->set = _setintegers<google::protobuf::int64>; break;
+                case google::protobuf::FieldDescriptor::CPPTYPE_UINT32: plan->push = _pushintegers<google::protobuf::uint32>; plan->set = _setintegers<google::protobuf::uint32>; break;
+                case google::protobuf::FieldDescriptor::CPPTYPE_UINT64: plan->push = _pushintegers<google::protobuf::uint64>; plan->set = _setintegers<google::protobuf::uint64>; break;
+                case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE: plan->push = _pushnumbers<double>; plan->set = _setnumbers<double>; break;
+                case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT: plan->push = _pushnumbers<float>; plan->set = _setnumbers<float>; break;
+                case google::protobuf::FieldDescriptor::CPPTYPE_BOOL: plan->push = _pushbools; plan->set = _setbools; break;
+                case google::protobuf::FieldDescriptor::CPPTYPE_ENUM: plan->push = _pushenums; plan->set = _setenums; break;
+                case google::protobuf::FieldDescriptor::CPPTYPE_STRING:
+                    plan->push = field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES ? _pushstrings<true> : _pushstrings<false>;
+                    plan->set = _setstrings;
+                    break;
+                case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE: plan->push = _pushmessages; plan->set = _setmessages; break;
+            }
+        }
+        else
+        {
+            switch (field->cpp_type())
+            {
+                case google::protobuf::FieldDescriptor::CPPTYPE_INT32: plan->push = _pushinteger<int32_t, &R::GetInt32>; plan->set = _setinteger<int32_t, &R::SetInt32>; break;
+                case google::protobuf::FieldDescriptor::CPPTYPE_INT64: plan->push = _pushinteger<int64_t, &R::GetInt64>; plan->set = _setinteger<int64_t, &R::SetInt64>; break;
+                case google::protobuf::FieldDescriptor::CPPTYPE_UINT32: plan->push = _pushinteger<uint32_t, &R::GetUInt32>; plan->set = _setinteger<uint32_t, &R::SetUInt32>; break;
+                case google::protobuf::FieldDescriptor::CPPTYPE_UINT64: plan->push = _pushinteger<uint64_t, &R::GetUInt64>; plan->set = _setinteger<uint64_t, &R::SetUInt64>; break;
+                case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE: plan->push = _pushnumber<double, &R::GetDouble>; plan->set = _setnumber<double, &R::SetDouble>; break;
+                case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT: plan->push = _pushnumber<float, &R::GetFloat>; plan->set = _setnumber<float, &R::SetFloat>; break;
+                case google::protobuf::FieldDescriptor::CPPTYPE_BOOL: plan->push = _pushbool; plan->set = _setbool; break;
+                case google::protobuf::FieldDescriptor::CPPTYPE_ENUM: plan->push = _pushenum; plan->set = _setenum; break;
+                case google::protobuf::FieldDescriptor::CPPTYPE_STRING:
+                    plan->push = field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES ? _pushstring<true> : _pushstring<false>;
+                    plan->set = _setstring;
+                    break;
+                case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE: plan->push = _pushmessage; plan->set = _setmessage; break;
+            }
+        }
+    }
+
+    static size_t _planslot(const google::protobuf::Descriptor* pDescriptor, size_t mask)
+    {
+        size_t h = (size_t)pDescriptor;
+        return (h ^ (h >> 7) ^ (h >> 17)) & mask;
+    }
+
+    static void _insertplan(PlanTable* pTable, const MessagePlan* pPlan)
+    {
+        size_t i = _planslot(pPlan->descriptor, pTable->mask);
+        while (pTable->slots[i].load(std::memory_order_relaxed)) i = (i+1) & pTable->mask;
+        pTable->slots[i].store(pPlan, std::memory_order_release);
+    }
+
+    // lock held
+    static void _publishplan(PlanRegistry* pRegistry, const MessagePlan* pPlan)
+    {
+        PlanTable* pTable = pRegistry->table.load(std::memory_order_relaxed);
+
+        if (pTable == nullptr || (pRegistry->published + 1) * 2 > pTable->mask + 1)
+        {
+            PlanTable* pGrown = new PlanTable(pTable ? (pTable->mask + 1) * 2 : 64);
+            pRegistry->tables.emplace_back(pGrown);
+            for (size_t i=0; pTable && i<=pTable->mask; i++)
+            {
+                auto pOld = pTable->slots[i].load(std::memory_order_relaxed);
+                if (pOld) _insertplan(pGrown, pOld);
+            }
+            pRegistry->table.store(pGrown, std::memory_order_release);
+            pTable = pGrown;
+        }
+        _insertplan(pTable, pPlan);
+        pRegistry->published++;
+    }
+
+    static const MessagePlan* _findplan(PlanRegistry* pRegistry, const google::protobuf::Descriptor* pDescriptor)
+    {
+        const PlanTable* pTable = pRegistry->table.load(std::memory_order_acquire);
+        const MessagePlan* pPlan;
+
+        if (pTable == nullptr) return nullptr;
+        for (size_t i = _planslot(pDescriptor, pTable->mask); (pPlan = pTable->slots[i].load(std::memory_order_acquire)) != nullptr; i = (i+1) & pTable->mask)
+        {
+            if (pPlan->descriptor == pDescriptor) return pPlan;
+        }
+        return nullptr;
+    }
+
+    // plans become visible to lock free lookups only once the whole group of the outer call is compiled
+    static const MessagePlan* _compileplan(PlanRegistry* pRegistry, const google::protobuf::Descriptor* pDescriptor)
+    {
+        std::lock_guard<std::recursive_mutex> guard(pRegistry->lock);
+        MessagePlan* pPlan;
+        int maxnumber = 0;
+
+        auto it = pRegistry->plans.find(pDescriptor);
+        if (it != pRegistry->plans.end()) return it->second.get();
+
+        // registered before its fields are compiled, so recursive message types resolve to it
+        auto &slot = pRegistry->plans[pDescriptor];
+        slot.reset(new MessagePlan());
+        pPlan = slot.get();
+        pPlan->descriptor = pDescriptor;
+        pRegistry->pending.push_back(pPlan);
+        pRegistry->depth++;
+
+        pPlan->fields.resize(pDescriptor->field_count());
+        for (int i=0; i<pDescriptor->field_count(); i++)
+        {
+            _compilefield(pRegistry, &pPlan->fields[i], pDescriptor->field(i));
+            if (pPlan->fields[i].number > maxnumber) maxnumber = pPlan->fields[i].number;
+        }
+
+        pPlan->numbers.resize(std::min(maxnumber, 4 * pDescriptor->field_count() + 16) + 1);
+        for (int i=0; i<pDescriptor->field_count(); i++)
+        {
+            if (pPlan->fields[i].number < (int)pPlan->numbers.size()) pPlan->numbers[pPlan->fields[i].number] = i+1;
+        }
+
+        pPlan->required = false;
+        for (int i=0; i<pDescriptor->field_count(); i++)
+        {
+            if (pDescriptor->field(i)->is_required()) pPlan->required = true;
+        }
+
+        if (--pRegistry->depth == 0)
+        {
+            for (bool changed = true; changed; )     //spread over the group, published plans are final already
+            {
+                changed = false;
+                for (auto pDone : pRegistry->pending)
+                {
+                    for (size_t i=0; !pDone->required && i<pDone->fields.size(); i++)
+                    {
+                        if (pDone->fields[i].sub && pDone->fields[i].sub->required) pDone->required = changed = true;
+                    }
+                }
+            }
+            for (auto pDone : pRegistry->pending) _publishplan(pRegistry, pDone);
+            pRegistry->pending.clear();
+        }
+        return pPlan;
+    }
+
+    // plans of generated types are compiled once per process and live until exit
+    static PlanRegistry* _generatedplans()
+    {
+        static PlanRegistry* pRegistry = new PlanRegistry();
+        return pRegistry;
+    }
+
+    // a new lua_State finds plans other states compiled, only the string keys are built per state
+    static const MessagePlan* _getplan(lua_State *L, const google::protobuf::Descriptor* pDescriptor)
+    {
+        PlanRegistry* pRegistry = _getstate(L)->registry;
+        const MessagePlan* pPlan = _findplan(pRegistry, pDescriptor);
+
+        return pPlan ? pPlan : _compileplan(pRegistry, pDescriptor);
+    }
+
+    static const FieldPlan* _findfield(const MessagePlan* pPlan, int number)
+    {
+        const google::protobuf::FieldDescriptor* field;
+
+        if (number < (int)pPlan->numbers.size())
+        {
+            int index = pPlan->numbers[number];
+            return index ? &pPlan->fields[index-1] : nullptr;
+        }
+
+        field = pPlan->descriptor->FindFieldByNumber(number);
+        return field ? &pPlan->fields[field->index()] : nullptr;
+    }
+
+    // pushes the interned field names of a plan: keys[index + 1] = name, keys[name] = index + 1
+    static void _pushkeys(lua_State *L, const MessagePlan* pPlan)
+    {
+        if (lua_rawgetp(L, lua_upvalueindex(5), pPlan->descriptor) != LUA_TNIL) return;
+        lua_pop(L, 1);
+
+        lua_createtable(L, pPlan->fields.size(), pPlan->fields.size());
+        for (size_t i=0; i<pPlan->fields.size(); i++)
+        {
+            auto &name = pPlan->fields[i].field->name();
+            lua_pushlstring(L, name.c_str(), name.length());
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, -3, i+1);
+            lua_pushinteger(L, i+1);
+            lua_rawset(L, -3);
+        }
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, lua_upvalueindex(5), pPlan->descriptor);
+    }
+
+    // field is set as ListFields would report it
+    static bool _hasfield(const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const google::protobuf::FieldDescriptor* field)
+    {
+        return field->is_repeated() ? pReflection->FieldSize(*pMsg, field) > 0 : pReflection->HasField(*pMsg, field);
+    }
+
+    // deserialize_into: key at top, table t => key, value, refilling the old value of a message or repeated field
+    static void _pushreused(lua_State *L, int t, const google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const FieldPlan* plan)
+    {
+        int old, len;
+
+        lua_pushvalue(L, -1);
+        old = lua_gettop(L);
+        if (lua_rawget(L, t) != LUA_TTABLE || (!plan->field->is_repeated() && plan->field->cpp_type() != google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE))
+        {
+            plan->push(L, pMsg, pReflection, plan);
+            lua_remove(L, old);
+            return;
+        }
+
+        if (plan->field->is_map())                     //keys of the old map would survive otherwise
+        {
+            lua_pushnil(L);
+            while (lua_next(L, old) != 0)
+            {
+                lua_pop(L, 1);
+                lua_pushvalue(L, -1);
+                lua_pushnil(L);
+                lua_rawset(L, old);
+            }
+        }
+        len = lua_rawlen(L, old);
+
+        _offertable(L, old);
+        plan->push(L, pMsg, pReflection, plan);
+        _getstate(L)->reuse = 0;
+
+        if (plan->field->is_repeated() && lua_rawequal(L, -1, old))
+        {
+            for (int i=len; i>pReflection->FieldSize(*pMsg, plan->field); i--)
+            {
+                lua_pushnil(L);
+                lua_rawseti(L, old, i);
+            }
+        }
+        lua_remove(L, old);
+    }
+
+    static void _msg2table(lua_State *L, const google::protobuf::Message* pMsg)
+    {
+        const google::protobuf::Message::Reflection* pReflection;
+        const MessagePlan* pPlan;
+        int count = 0, t;
+        bool reused;
+
+ 		pReflection = pMsg->GetReflection();
+		if (pReflection == nullptr) luaL_error(L, "GetReflection Failed!");
+
+        pPlan = _getplan(L, pMsg->GetDescriptor());
+
+        // only extendable messages need ListFields, the rest walk the plan and allocate nothing but the table
+        if (pPlan->descriptor->extension_range_count() > 0)
+        {
+            std::vector<const google::protobuf::FieldDescriptor*> fields;
+
+            pReflection->ListFields(*pMsg, &fields);
+            reused = _newtable(L, 0, fields.size());
+            t = lua_gettop(L);
+            _pushkeys(L, pPlan);                        //table, keys
+
+            for (size_t i=0; reused && i<pPlan->fields.size(); i++)
+            {
+                if (_hasfield(pMsg, pReflection, pPlan->fields[i].field)) continue;
+                lua_rawgeti(L, -1, i+1);
+                lua_pushnil(L);
+                lua_rawset(L, t);
+            }
+
+            for (auto field : fields)
+            {
+                if (field->is_extension())
+                {
+                    FieldPlan plan;
+                    _compilefield(_getstate(L)->registry, &plan, field);
+                    lua_pushstring(L, field->name().c_str());
+                    plan.push(L, pMsg, pReflection, &plan);
+                }
+                else
+                {
+                    auto &plan = pPlan->fields[field->index()];
+                    lua_rawgeti(L, -1, field->index()+1);
+                    if (reused) _pushreused(L, t, pMsg, pReflection, &plan);
+                    else plan.push(L, pMsg, pReflection, &plan);
+                }
+                lua_rawset(L, t);
+            }
+            lua_pop(L, 1);
+            return;
+        }
+
+        for (auto &plan : pPlan->fields)
+            if (_hasfield(pMsg, pReflection, plan.field)) count++;
+
+        reused = _newtable(L, 0, count);
+        if (count == 0 && !reused) return;
+        t = lua_gettop(L);
+        _pushkeys(L, pPlan);                            //table, keys
+
+        for (auto &plan : pPlan->fields)
+        {
+            if (!_hasfield(pMsg, pReflection, plan.field))
+            {
+                if (!reused) continue;
+                lua_rawgeti(L, -1, plan.field->index()+1);
+                lua_pushnil(L);
+            }
+            else
+            {
+                lua_rawgeti(L, -1, plan.field->index()+1);
+                if (reused) _pushreused(L, t, pMsg, pReflection, &plan);
+                else plan.push(L, pMsg, pReflection, &plan);
+            }
+            lua_rawset(L, t);
+            if (!reused && --count == 0) break;
+        }
+        lua_pop(L, 1);
+    }
+
+    static void _table2msg(lua_State *L, google::protobuf::Message* pMsg)
+    {
+        const google::protobuf::Message::Reflection* pReflection;
+        const google::protobuf::Descriptor* pDescriptor;
+        const MessagePlan* pPlan;
+        int keys;
+  		pReflection = pMsg->GetReflection();
+        pDescriptor = pMsg->GetDescriptor();
+		if (pReflection == nullptr || pDescriptor == nullptr) return;
+       
+        if (!lua_istable(L, -1)) return;
+
+        pPlan = _getplan(L, pDescriptor);
+        _pushkeys(L, pPlan);                            //table, keys
+        lua_insert(L, -2);                              //keys, table
+        keys = lua_gettop(L) - 1;
+
+        lua_pushnil(L);
+        while (lua_next(L, -2) != 0)
+        {
+            lua_pushvalue(L, -2);
+            lua_rawget(L, keys);
+            auto index = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            if (index == 0) luaL_error(L, "invalid field %s!", luaL_checkstring(L, -2));
+            auto &plan = pPlan->fields[index-1];
+            plan.set(L, pMsg, pReflection, &plan);
+            lua_pop(L, 1);
+        }
+        lua_insert(L, -2);                              //table, keys
+        lua_pop(L, 1);
+    }
+
+    static bool _decodemsg(lua_State *L, google::protobuf::io::CodedInputStream* input, const MessagePlan* pPlan, google::protobuf::uint32 endtag, int mask = 0);
+
+    static void _pushdefault(lua_State *L, const google::protobuf::FieldDescriptor* field)
+    {
+        switch (field->cpp_type())
+        {
+            case google::protobuf::FieldDescriptor::CPPTYPE_INT32: lua_pushinteger(L, field->default_value_int32()); break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_INT64: lua_pushinteger(L, field->default_value_int64()); break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_UINT32: lua_pushinteger(L, field->default_value_uint32()); break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_UINT64: lua_pushinteger(L, field->default_value_uint64()); break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE: lua_pushnumber(L, field->default_value_double()); break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT: lua_pushnumber(L, field->default_value_float()); break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_BOOL: lua_pushboolean(L, field->default_value_bool()); break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_ENUM: _pushenumvalue(L, field->enum_type(), field->default_value_enum()->number()); break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_STRING: lua_pushlstring(L, field->default_value_string().c_str(), field->default_value_string().length()); break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE: lua_newtable(L); break;
+            default: lua_pushnil(L); break;
+        }
+    }
+
+    // nested message or group => table at top, mask selects its fields when not 0
+    static bool _decodesub(lua_State *L, google::protobuf::io::CodedInputStream* input, const FieldPlan* plan, int mask = 0)
+    {
+        google::protobuf::uint32 length;
+        bool ok;
+
+        if (!input->IncrementRecursionDepth()) return false;
+
+        if (plan->field->type() == google::protobuf::FieldDescriptor::TYPE_GROUP)
+        {
+            ok = _decodemsg(L, input, plan->sub, google::protobuf::internal::WireFormatLite::MakeTag(plan->number, google::protobuf::internal::WireFormatLite::WIRETYPE_END_GROUP), mask);
+        }
+        else if (_readlength(input, &length))
+        {
+            auto limit = input->PushLimit(length);
+            ok = _decodemsg(L, input, plan->sub, 0, mask) && input->ConsumedEntireMessage();
+            input->PopLimit(limit);
+        }
+        else ok = false;
+
+        input->DecrementRecursionDepth();
+        return ok;
+    }
+
+    // map entry => map[key] = value, map table at top
+    static bool _decodeentry(lua_State *L, google::protobuf::io::CodedInputStream* input, const FieldPlan* plan)
+    {
+        google::protobuf::uint32 length, tag;
+        const FieldPlan* kplan, *vplan;
+        int k, v;
+        bool unknown = false;
+
+        _entryplans(plan, &kplan, &vplan);
+        if (!_readlength(input, &length)) return false;
+        auto limit = input->PushLimit(length);
+
+        lua_pushnil(L);
+        k = lua_gettop(L);
+        lua_pushnil(L);
+        v = lua_gettop(L);
+
+        while ((tag = input->ReadTag()) != 0)
+        {
+            int number = google::protobuf::internal::WireFormatLite::GetTagFieldNumber(tag);
+            auto wiretype = google::protobuf::internal::WireFormatLite::GetTagWireType(tag);
+            const FieldPlan* field = number == 1 ? kplan : number == 2 ? vplan : nullptr;
+
+            if (field == nullptr || wiretype != field->wiretype)
+            {
+                if (!google::protobuf::internal::WireFormatLite::SkipField(input, tag)) return false;
+            }
+            else if (field->decode)
+            {
+                if (!field->decode(L, input, field)) return false;
+                unknown = number == 2 && lua_isnil(L, -1) && !field->nopresence;
+                lua_replace(L, number == 1 ? k : v);
+            }
+            else
+            {
+                if (!lua_istable(L, v))
+                {
+                    lua_newtable(L);
+                    lua_replace(L, v);
+                }
+                lua_pushvalue(L, v);
+                if (!_decodesub(L, input, field)) return false;
+                lua_pop(L, 1);
+            }
+        }
+        if (!input->ConsumedEntireMessage()) return false;
+        input->PopLimit(limit);
+
+        if (unknown)                                    //an unknown proto2 enum value drops the whole entry, as the parser does
+        {
+            lua_pop(L, 2);
+            return true;
+        }
+        if (lua_isnil(L, k)) { _pushdefault(L, kplan->field); lua_replace(L, k); }
+        if (lua_isnil(L, v)) { _pushdefault(L, vplan->field); lua_replace(L, v); }
+        lua_rawset(L, -3);
+        return true;
+    }
+
+    template <typename T, google::protobuf::internal::WireFormatLite::FieldType F, bool Integer>
+    static bool _decodefixed(lua_State *L, google::protobuf::io::CodedInputStream* input, size_t count, size_t n)
+    {
+        T value;
+        for (size_t i=1; i<=count; i++)
+        {
+            if (!google::protobuf::internal::WireFormatLite::ReadPrimitive<T, F>(input, &value)) return false;
+            if (Integer) lua_pushinteger(L, (lua_Integer)value);
+            else lua_pushnumber(L, value);
+            lua_rawseti(L, -2, n+i);
+        }
+        return true;
+    }
+
+    // packed scalars => appended to the array at top, its key below it
+    // a new array is presized from the element count: exact for fixed width types, counted from the
+    // varint terminator bytes otherwise; fixed width elements are read without the per element handler
+    static bool _toomany(lua_State *L)
+    {
+        _getstate(L)->failure = "too many repeated elements";
+        return false;
+    }
+
+    static bool _decodepacked(lua_State *L, google::protobuf::io::CodedInputStream* input, const FieldPlan* plan, int table, size_t maxrepeated)
+    {
+        typedef google::protobuf::internal::WireFormatLite W;
+        google::protobuf::uint32 length;
+        size_t n, count, width;
+        const void* data;
+        bool ok;
+
+        n = lua_rawlen(L, -1);
+        if (!_readlength(input, &length) || !_viewlength(input, length, &data)) return false;   //the count below trusts the length
+
+        switch (plan->field->type())
+        {
+            case google::protobuf::FieldDescriptor::TYPE_FIXED32:
+            case google::protobuf::FieldDescriptor::TYPE_SFIXED32:
+            case google::protobuf::FieldDescriptor::TYPE_FLOAT: width = 4; break;
+            case google::protobuf::FieldDescriptor::TYPE_FIXED64:
+            case google::protobuf::FieldDescriptor::TYPE_SFIXED64:
+            case google::protobuf::FieldDescriptor::TYPE_DOUBLE: width = 8; break;
+            default: width = 0; break;
+        }
+
+        count = 0;
+        if (width)
+        {
+            if (length % width) return false;
+            count = length / width;
+        }
+        else
+        {
+            const google::protobuf::uint8* p = (const google::protobuf::uint8*)data;
+            for (size_t i=0; i<length; i++) count += p[i] < 0x80;
+        }
+        if (maxrepeated > 0 && n + count > maxrepeated) return _toomany(L);
+
+        if (n == 0 && count > 0)
+        {
+            lua_pop(L, 1);
+            lua_createtable(L, (int)count, 0);
+            lua_pushvalue(L, -2);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, table);
+        }
+
+        auto limit = input->PushLimit(length);
+        switch (plan->field->type())
+        {
+            case google::protobuf::FieldDescriptor::TYPE_FIXED32: ok = _decodefixed<google::protobuf::uint32, W::TYPE_FIXED32, true>(L, input, count, n); break;
+            case google::protobuf::FieldDescriptor::TYPE_SFIXED32: ok = _decodefixed<google::protobuf::int32, W::TYPE_SFIXED32, true>(L, input, count, n); break;
+            case google::protobuf::FieldDescriptor::TYPE_FIXED64: ok = _decodefixed<google::protobuf::uint64, W::TYPE_FIXED64, true>(L, input, count, n); break;
+            case google::protobuf::FieldDescriptor::TYPE_SFIXED64: ok = _decodefixed<google::protobuf::int64, W::TYPE_SFIXED64, true>(L, input, count, n); break;
+            case google::protobuf::FieldDescriptor::TYPE_FLOAT: ok = _decodefixed<float, W::TYPE_FLOAT, false>(L, input, count, n); break;
+            case google::protobuf::FieldDescriptor::TYPE_DOUBLE: ok = _decodefixed<double, W::TYPE_DOUBLE, false>(L, input, count, n); break;
+            default:
+                ok = true;
+                while (input->BytesUntilLimit() > 0)
+                {
+                    if (!(ok = plan->decode(L, input, plan))) break;
+                    if (lua_isnil(L, -1)) lua_pop(L, 1);
+                    else lua_rawseti(L, -2, ++n);
+                }
+                break;
+        }
+        input->PopLimit(limit);
+        return ok;
+    }
+
+    // apply_delta: packed field numbers => those fields of the table are set to nil
+    static bool _decodecleared(lua_State *L, google::protobuf::io::CodedInputStream* input, const MessagePlan* pPlan, int table, int keys)
+    {
+        google::protobuf::uint32 length, number;
+
+        if (!_readlength(input, &length)) return false;
+        auto limit = input->PushLimit(length);
+        while (input->BytesUntilLimit() > 0)
+        {
+            if (!input->ReadVarint32(&number)) return false;
+            auto plan = _findfield(pPlan, (int)number);
+            if (plan == nullptr) continue;
+            lua_rawgeti(L, keys, plan->field->index()+1);
+            lua_pushnil(L);
+            lua_rawset(L, table);
+        }
+        input->PopLimit(limit);
+        return true;
+    }
+
+    // wire fields => table at top, stops at endtag or at the current limit
+    // with a mask (see _compilemask) unselected fields are skipped on the wire
+    static bool _decodemsg(lua_State *L, google::protobuf::io::CodedInputStream* input, const MessagePlan* pPlan, google::protobuf::uint32 endtag, int mask)
+    {
+        google::protobuf::uint32 tag;
+        int table, keys, submask, number, last = 0;
+        CodecState* pState = _getstate(L);
+        bool delta = pState->delta;
+        size_t maxrepeated = pState->strict ? pState->maxrepeated : 0, base = pState->entries.size();
+
+        luaL_checkstack(L, 8, "message nested too deep!");
+        table = lua_gettop(L);
+        _pushkeys(L, pPlan);
+        keys = lua_gettop(L);
+
+        while ((tag = input->ReadTag()) != 0)
+        {
+            if (tag == endtag) break;
+
+            auto wiretype = google::protobuf::internal::WireFormatLite::GetTagWireType(tag);
+            number = google::protobuf::internal::WireFormatLite::GetTagFieldNumber(tag);
+            auto plan = _findfield(pPlan, number);
+            if (plan == nullptr && delta && number == DELTA_CLEARED && wiretype == google::protobuf::internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED)
+            {
+                if (!_decodecleared(L, input, pPlan, table, keys)) return false;
+                continue;
+            }
+            submask = 0;
+            if (plan != nullptr && mask != 0)
+            {
+                lua_settop(L, keys);
+                switch (lua_rawgeti(L, mask, plan->field->index()+1))
+                {
+                    case LUA_TNIL: plan = nullptr; break;
+                    case LUA_TTABLE: submask = keys + 1; break;
+                    default: break;
+                }
+            }
+            if (plan == nullptr)
+            {
+                if (!google::protobuf::internal::WireFormatLite::SkipField(input, tag)) return false;
+                continue;
+            }
+
+            auto field = plan->field;
+            auto elemtype = google::protobuf::internal::WireFormatLite::WireTypeForFieldType((google::protobuf::internal::WireFormatLite::FieldType)field->type());
+            bool packed = field->is_packable() && wiretype == google::protobuf::internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED;
+
+            if (wiretype != elemtype && !packed)
+            {
+                if (!google::protobuf::internal::WireFormatLite::SkipField(input, tag)) return false;
+                continue;
+            }
+
+            lua_rawgeti(L, keys, field->index()+1);     //table, keys, key
+
+            if (!field->is_repeated())
+            {
+                if (plan->decode)
+                {
+                    if (!plan->decode(L, input, plan)) return false;
+                    if (lua_isnil(L, -1) && !plan->nopresence)
+                    {
+                        lua_settop(L, keys);            //unknown proto2 enum value, the field keeps what it had
+                        continue;
+                    }
+                }
+                else
+                {
+                    lua_pushvalue(L, -1);
+                    if (lua_rawget(L, table) != LUA_TTABLE)  //merge repeated occurrences like MergeFrom does
+                    {
+                        lua_pop(L, 1);
+                        lua_newtable(L);
+                    }
+                    if (!_decodesub(L, input, plan, submask)) return false;
+                }
+
+                auto oneof = field->containing_oneof();
+                if (oneof)
+                {
+                    for (int i=0; i<oneof->field_count(); i++)
+                    {
+                        if (oneof->field(i) == field) continue;
+                        lua_rawgeti(L, keys, oneof->field(i)->index()+1);
+                        lua_pushnil(L);
+                        lua_rawset(L, table);
+                    }
+                }
+                lua_rawset(L, table);
+                continue;
+            }
+
+            lua_pushvalue(L, -1);
+            if (lua_rawget(L, table) != LUA_TTABLE || (delta && number != last))   //table, keys, key, array; a delta replaces the whole field
+            {
+                lua_pop(L, 1);
+                lua_newtable(L);
+                lua_pushvalue(L, -2);
+                lua_pushvalue(L, -2);
+                lua_rawset(L, table);
+            }
+            last = number;
+
+            if (field->is_map())
+            {
+                if (maxrepeated > 0 && pState->entries.size() == base) pState->entries.resize(base + pPlan->fields.size());   //other fields may come between entries
+                do
+                {
+                    if (!_decodeentry(L, input, plan)) return false;
+                    if (maxrepeated > 0 && ++pState->entries[base + field->index()] > maxrepeated) return _toomany(L);
+                } while (input->ExpectTag(tag));
+            }
+            else if (packed)
+            {
+                if (!_decodepacked(L, input, plan, table, maxrepeated)) return false;
+                if (maxrepeated > 0 && lua_rawlen(L, -1) > maxrepeated) return _toomany(L);
+            }
+            else
+            {
+                auto n = lua_rawlen(L, -1);
+                do
+                {
+                    if (plan->decode)
+                    {
+                        if (!plan->decode(L, input, plan)) return false;
+                        if (lua_isnil(L, -1)) { lua_pop(L, 1); continue; }
+                    }
+                    else
+                    {
+                        lua_newtable(L);
+                        if (!_decodesub(L, input, plan, submask)) return false;
+                    }
+                    lua_rawseti(L, -2, ++n);
+                    if (maxrepeated > 0 && n > maxrepeated) return _toomany(L);
+                } while (input->ExpectTag(tag));
+            }
+
+            if (lua_rawlen(L, -1) == 0 && !field->is_map())
+            {
+                lua_pop(L, 1);                          //an empty packed field leaves no trace, as in ListFields
+                lua_pushnil(L);
+                lua_rawset(L, table);
+            }
+            else lua_pop(L, 2);
+        }
+
+        lua_settop(L, table);
+        pState->entries.resize(base);
+        return endtag == 0 || tag == endtag;
+    }
+
+    // lua value converted for the wire, shared by the size and write passes
+    struct WireValue
+    {
+        union
+        {
+            google::protobuf::uint64 u64;
+            google::protobuf::uint32 u32;
+            double d;
+            float f;
+        };
+        const char* data;
+        size_t length;
+    };
+
+    // lua value at idx => wire value with the same checks as the set handlers, false when the field is left out
+    static bool _checkscalar(lua_State *L, int idx, const FieldPlan* plan, WireValue* v)
+    {
+        switch (plan->field->cpp_type())
+        {
+            case google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+            case google::protobuf::FieldDescriptor::CPPTYPE_UINT32: v->u32 = (google::protobuf::uint32)luaL_checkinteger(L, idx); v->u64 = v->u32; break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+            case google::protobuf::FieldDescriptor::CPPTYPE_UINT64: v->u64 = (google::protobuf::uint64)luaL_checkinteger(L, idx); break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE: v->d = luaL_checknumber(L, idx); break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT: v->f = (float)luaL_checknumber(L, idx); break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_BOOL: v->u64 = lua_toboolean(L, idx) ? 1 : 0; break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
+            {
+                auto enumvalue = _checkenum(L, idx, plan->field->enum_type());
+                int number;
+                if (enumvalue) number = enumvalue->number();
+                else if (!_openenum(L, idx, plan->field, &number))
+                {
+                    if (plan->field->is_repeated()) luaL_error(L, "Invalid Enum In Repeated Field! %s", lua_tostring(L, idx));
+                    return false;
+                }
+                v->u32 = (google::protobuf::uint32)number;
+                v->u64 = v->u32;
+            } break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_STRING: v->data = luaL_checklstring(L, idx, &v->length); break;
+            default: return false;
+        }
+
+        if (!plan->nopresence) return true;
+
+        switch (plan->field->cpp_type())
+        {
+            case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE: return v->d != 0 || std::signbit(v->d);
+            case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT: return v->f != 0 || std::signbit(v->f);
+            case google::protobuf::FieldDescriptor::CPPTYPE_STRING: return v->length != 0;
+            case google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+            case google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+            case google::protobuf::FieldDescriptor::CPPTYPE_ENUM: return v->u32 != 0;
+            default: return v->u64 != 0;
+        }
+    }
+
+    // encoded size of a scalar without its tag
+    static size_t _scalarsize(const FieldPlan* plan, const WireValue* v)
+    {
+        typedef google::protobuf::internal::WireFormatLite W;
+
+        switch (plan->field->type())
+        {
+            case google::protobuf::FieldDescriptor::TYPE_INT32:
+            case google::protobuf::FieldDescriptor::TYPE_ENUM: return W::Int32Size((google::protobuf::int32)v->u32);
+            case google::protobuf::FieldDescriptor::TYPE_SINT32: return W::SInt32Size((google::protobuf::int32)v->u32);
+            case google::protobuf::FieldDescriptor::TYPE_UINT32: return W::UInt32Size(v->u32);
+            case google::protobuf::FieldDescriptor::TYPE_SINT64: return W::SInt64Size((google::protobuf::int64)v->u64);
+            case google::protobuf::FieldDescriptor::TYPE_INT64:
+            case google::protobuf::FieldDescriptor::TYPE_UINT64: return W::UInt64Size(v->u64);
+            case google::protobuf::FieldDescriptor::TYPE_FIXED32:
+            case google::protobuf::FieldDescriptor::TYPE_SFIXED32:
+            case google::protobuf::FieldDescriptor::TYPE_FLOAT: return 4;
+            case google::protobuf::FieldDescriptor::TYPE_FIXED64:
+            case google::protobuf::FieldDescriptor::TYPE_SFIXED64:
+            case google::protobuf::FieldDescriptor::TYPE_DOUBLE: return 8;
+            case google::protobuf::FieldDescriptor::TYPE_BOOL: return 1;
+            case google::protobuf::FieldDescriptor::TYPE_STRING:
+            case google::protobuf::FieldDescriptor::TYPE_BYTES: return W::LengthDelimitedSize(v->length);
+            default: return 0;
+        }
+    }
+
+    static google::protobuf::uint8* _writescalar(const FieldPlan* plan, const WireValue* v, google::protobuf::uint8* p)
+    {
+        typedef google::protobuf::internal::WireFormatLite W;
+        typedef google::protobuf::io::CodedOutputStream O;
+
+        switch (plan->field->type())
+        {
+            case google::protobuf::FieldDescriptor::TYPE_INT32:
+            case google::protobuf::FieldDescriptor::TYPE_ENUM: return O::WriteVarint32SignExtendedToArray((google::protobuf::int32)v->u32, p);
+            case google::protobuf::FieldDescriptor::TYPE_SINT32: return O::WriteVarint32ToArray(W::ZigZagEncode32((google::protobuf::int32)v->u32), p);
+            case google::protobuf::FieldDescriptor::TYPE_UINT32: return O::WriteVarint32ToArray(v->u32, p);
+            case google::protobuf::FieldDescriptor::TYPE_SINT64: return O::WriteVarint64ToArray(W::ZigZagEncode64((google::protobuf::int64)v->u64), p);
+            case google::protobuf::FieldDescriptor::TYPE_INT64:
+            case google::protobuf::FieldDescriptor::TYPE_UINT64: return O::WriteVarint64ToArray(v->u64, p);
+            case google::protobuf::FieldDescriptor::TYPE_FIXED32:
+            case google::protobuf::FieldDescriptor::TYPE_SFIXED32: return O::WriteLittleEndian32ToArray(v->u32, p);
+            case google::protobuf::FieldDescriptor::TYPE_FLOAT: return O::WriteLittleEndian32ToArray(W::EncodeFloat(v->f), p);
+            case google::protobuf::FieldDescriptor::TYPE_FIXED64:
+            case google::protobuf::FieldDescriptor::TYPE_SFIXED64: return O::WriteLittleEndian64ToArray(v->u64, p);
+            case google::protobuf::FieldDescriptor::TYPE_DOUBLE: return O::WriteLittleEndian64ToArray(W::EncodeDouble(v->d), p);
+            case google::protobuf::FieldDescriptor::TYPE_BOOL: *p = (google::protobuf::uint8)v->u64; return p + 1;
+            case google::protobuf::FieldDescriptor::TYPE_STRING:
+            case google::protobuf::FieldDescriptor::TYPE_BYTES:
+                p = O::WriteVarint32ToArray((google::protobuf::uint32)v->length, p);
+                return O::WriteRawToArray(v->data, (int)v->length, p);
+            default: return p;
+        }
+    }
+
+    static size_t _tagsize(const FieldPlan* plan)
+    {
+        return google::protobuf::io::CodedOutputStream::VarintSize32(google::protobuf::internal::WireFormatLite::MakeTag(plan->number, google::protobuf::internal::WireFormatLite::WIRETYPE_VARINT));
+    }
+
+    static google::protobuf::uint8* _writetag(const FieldPlan* plan, google::protobuf::internal::WireFormatLite::WireType wiretype, google::protobuf::uint8* p)
+    {
+        return google::protobuf::io::CodedOutputStream::WriteTagToArray(google::protobuf::internal::WireFormatLite::MakeTag(plan->number, wiretype), p);
+    }
+
+    static size_t _sizemsg(lua_State *L, EncodeBuffer* pBuffer, const MessagePlan* pPlan);
+    static google::protobuf::uint8* _writemsg(lua_State *L, EncodeBuffer* pBuffer, const MessagePlan* pPlan, google::protobuf::uint8* p);
+
+    // single value of a field at top => size with tag
+    static size_t _sizesingle(lua_State *L, EncodeBuffer* pBuffer, const FieldPlan* plan)
+    {
+        WireValue v;
+        size_t size, slot;
+
+        if (plan->sub == nullptr)
+        {
+            if (!_checkscalar(L, -1, plan, &v)) return 0;
+            return _tagsize(plan) + _scalarsize(plan, &v);
+        }
+
+        if (plan->field->type() == google::protobuf::FieldDescriptor::TYPE_GROUP)
+        {
+            return 2 * _tagsize(plan) + (lua_istable(L, -1) ? _sizemsg(L, pBuffer, plan->sub) : 0);
+        }
+
+        slot = pBuffer->sizes.size();
+        pBuffer->sizes.push_back(0);
+        size = lua_istable(L, -1) ? _sizemsg(L, pBuffer, plan->sub) : 0;
+        pBuffer->sizes[slot] = size;
+        return _tagsize(plan) + google::protobuf::internal::WireFormatLite::LengthDelimitedSize(size);
+    }
+
+    static google::protobuf::uint8* _writesingle(lua_State *L, EncodeBuffer* pBuffer, const FieldPlan* plan, google::protobuf::uint8* p)
+    {
+        WireValue v;
+
+        if (plan->sub == nullptr)
+        {
+            if (!_checkscalar(L, -1, plan, &v)) return p;
+            p = _writetag(plan, google::protobuf::internal::WireFormatLite::WireTypeForFieldType((google::protobuf::internal::WireFormatLite::FieldType)plan->field->type()), p);
+            return _writescalar(plan, &v, p);
+        }
+
+        if (plan->field->type() == google::protobuf::FieldDescriptor::TYPE_GROUP)
+        {
+            p = _writetag(plan, google::protobuf::internal::WireFormatLite::WIRETYPE_START_GROUP, p);
+            if (lua_istable(L, -1)) p = _writemsg(L, pBuffer, plan->sub, p);
+            return _writetag(plan, google::protobuf::internal::WireFormatLite::WIRETYPE_END_GROUP, p);
+        }
+
+        p = _writetag(plan, google::protobuf::internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED, p);
+        p = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray((google::protobuf::uint32)pBuffer->sizes[pBuffer->cursor++], p);
+        return lua_istable(L, -1) ? _writemsg(L, pBuffer, plan->sub, p) : p;
+    }
+
+    // map key, value at top => entry size
+    static size_t _sizeentry(lua_State *L, EncodeBuffer* pBuffer, const FieldPlan* plan)
+    {
+        const FieldPlan* kplan, *vplan;
+        size_t size, slot;
+
+        _entryplans(plan, &kplan, &vplan);
+        slot = pBuffer->sizes.size();
+        pBuffer->sizes.push_back(0);
+
+        lua_pushvalue(L, -2);
+        size = _sizesingle(L, pBuffer, kplan);
+        lua_pop(L, 1);
+        size += _sizesingle(L, pBuffer, vplan);
+
+        pBuffer->sizes[slot] = size;
+        return _tagsize(plan) + google::protobuf::internal::WireFormatLite::LengthDelimitedSize(size);
+    }
+
+    static google::protobuf::uint8* _writeentry(lua_State *L, EncodeBuffer* pBuffer, const FieldPlan* plan, google::protobuf::uint8* p)
+    {
+        const FieldPlan* kplan, *vplan;
+
+        _entryplans(plan, &kplan, &vplan);
+        p = _writetag(plan, google::protobuf::internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED, p);
+        p = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray((google::protobuf::uint32)pBuffer->sizes[pBuffer->cursor++], p);
+
+        lua_pushvalue(L, -2);
+        p = _writesingle(L, pBuffer, kplan, p);
+        lua_pop(L, 1);
+        return _writesingle(L, pBuffer, vplan, p);
+    }
+
+    // field value at top => size with tags
+    // element i of the array or typed array at top => top
+    static void _pushelement(lua_State *L, TypedArray* pArray, size_t i)
+    {
+        if (pArray) _pusharrayat(L, pArray, i-1);
+        else lua_rawgeti(L, -1, i);
+    }
+
+    static size_t _sizefield(lua_State *L, EncodeBuffer* pBuffer, const FieldPlan* plan)
+    {
+        size_t size = 0, len;
+        TypedArray* pArray;
+
+        if (!plan->field->is_repeated()) return _sizesingle(L, pBuffer, plan);
+        pArray = plan->field->is_map() ? nullptr : _toarray(L, -1);
+        if (pArray == nullptr && !lua_istable(L, -1)) return 0;
+
+        if (plan->field->is_map())
+        {
+            lua_pushnil(L);
+            while (lua_next(L, -2) != 0)
+            {
+                size += _sizeentry(L, pBuffer, plan);
+                lua_pop(L, 1);
+            }
+            return size;
+        }
+
+        len = pArray ? pArray->count : lua_rawlen(L, -1);
+        if (len == 0) return 0;
+
+        if (plan->field->is_packed())
+        {
+            size_t slot = pBuffer->sizes.size();
+            pBuffer->sizes.push_back(0);
+            for (size_t i=1; i<=len; i++)
+            {
+                WireValue v;
+                _pushelement(L, pArray, i);
+                _checkscalar(L, -1, plan, &v);
+                size += _scalarsize(plan, &v);
+                lua_pop(L, 1);
+            }
+            pBuffer->sizes[slot] = size;
+            return _tagsize(plan) + google::protobuf::internal::WireFormatLite::LengthDelimitedSize(size);
+        }
+
+        for (size_t i=1; i<=len; i++)
+        {
+            _pushelement(L, pArray, i);
+            size += _sizesingle(L, pBuffer, plan);
+            lua_pop(L, 1);
+        }
+        return size;
+    }
+
+    static google::protobuf::uint8* _writefield(lua_State *L, EncodeBuffer* pBuffer, const FieldPlan* plan, google::protobuf::uint8* p)
+    {
+        size_t len;
+        TypedArray* pArray;
+
+        if (!plan->field->is_repeated()) return _writesingle(L, pBuffer, plan, p);
+        pArray = plan->field->is_map() ? nullptr : _toarray(L, -1);
+        if (pArray == nullptr && !lua_istable(L, -1)) return p;
+
+        if (plan->field->is_map())
+        {
+            lua_pushnil(L);
+            while (lua_next(L, -2) != 0)
+            {
+                p = _writeentry(L, pBuffer, plan, p);
+                lua_pop(L, 1);
+            }
+            return p;
+        }
+
+        len = pArray ? pArray->count : lua_rawlen(L, -1);
+        if (len == 0) return p;
+
+        if (plan->field->is_packed())
+        {
+            p = _writetag(plan, google::protobuf::internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED, p);
+            p = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray((google::protobuf::uint32)pBuffer->sizes[pBuffer->cursor++], p);
+            for (size_t i=1; i<=len; i++)
+            {
+                WireValue v;
+                _pushelement(L, pArray, i);
+                _checkscalar(L, -1, plan, &v);
+                p = _writescalar(plan, &v, p);
+                lua_pop(L, 1);
+            }
+            return p;
+        }
+
+        for (size_t i=1; i<=len; i++)
+        {
+            _pushelement(L, pArray, i);
+            p = _writesingle(L, pBuffer, plan, p);
+            lua_pop(L, 1);
+        }
+        return p;
+    }
+
+    // table at top => encoded size, nested lengths are appended to pBuffer->sizes
+    static size_t _sizemsg(lua_State *L, EncodeBuffer* pBuffer, const MessagePlan* pPlan)
+    {
+        size_t size = 0;
+        int keys;
+
+        luaL_checkstack(L, 8, "message nested too deep!");
+        _pushkeys(L, pPlan);
+        keys = lua_gettop(L);
+
+        lua_pushnil(L);
+        while (lua_next(L, -3) != 0)
+        {
+            lua_pushvalue(L, -2);
+            lua_rawget(L, keys);
+            auto index = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            if (index == 0) luaL_error(L, "invalid field %s!", luaL_checkstring(L, -2));
+            size += _sizefield(L, pBuffer, &pPlan->fields[index-1]);
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+        return size;
+    }
+
+    // table at top => bytes at p, walks the table in the same order as _sizemsg
+    static google::protobuf::uint8* _writemsg(lua_State *L, EncodeBuffer* pBuffer, const MessagePlan* pPlan, google::protobuf::uint8* p)
+    {
+        int keys;
+
+        _pushkeys(L, pPlan);
+        keys = lua_gettop(L);
+
+        lua_pushnil(L);
+        while (lua_next(L, -3) != 0)
+        {
+            lua_pushvalue(L, -2);
+            lua_rawget(L, keys);
+            auto index = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            p = _writefield(L, pBuffer, &pPlan->fields[index-1], p);
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+        return p;
+    }
+
+    // table at top => pBuffer->data
+    static void _encode(lua_State *L, EncodeBuffer* pBuffer, const MessagePlan* pPlan)
+    {
+        size_t size;
+        google::protobuf::uint8* p;
+
+        pBuffer->sizes.clear();
+        pBuffer->cursor = 0;
+        size = lua_istable(L, -1) ? _sizemsg(L, pBuffer, pPlan) : 0;
+
+        if (pBuffer->data.capacity() > ENCODE_BUFFER_RETAIN && size <= ENCODE_BUFFER_RETAIN) std::string().swap(pBuffer->data);
+        pBuffer->data.resize(size);
+        if (size == 0) return;
+
+        p = _writemsg(L, pBuffer, pPlan, (google::protobuf::uint8*)&pBuffer->data[0]);
+        if (p != (google::protobuf::uint8*)&pBuffer->data[0] + size) luaL_error(L, "table changed while encoding!");
+    }
+
+    // array of tables at idx => total size of the varint length delimited records
+    static size_t _sizebatch(lua_State *L, EncodeBuffer* pBuffer, const MessagePlan* pPlan, int idx)
+    {
+        size_t total = 0, size, slot, len;
+
+        pBuffer->sizes.clear();
+        pBuffer->cursor = 0;
+        len = lua_rawlen(L, idx);
+        for (size_t i=1; i<=len; i++)
+        {
+            lua_rawgeti(L, idx, i);
+            slot = pBuffer->sizes.size();
+            pBuffer->sizes.push_back(0);
+            size = lua_istable(L, -1) ? _sizemsg(L, pBuffer, pPlan) : 0;
+            pBuffer->sizes[slot] = size;
+            total += google::protobuf::internal::WireFormatLite::LengthDelimitedSize(size);
+            lua_pop(L, 1);
+        }
+        return total;
+    }
+
+    static google::protobuf::uint8* _writebatch(lua_State *L, EncodeBuffer* pBuffer, const MessagePlan* pPlan, int idx, google::protobuf::uint8* p)
+    {
+        size_t len;
+
+        len = lua_rawlen(L, idx);
+        for (size_t i=1; i<=len; i++)
+        {
+            lua_rawgeti(L, idx, i);
+            p = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray((google::protobuf::uint32)pBuffer->sizes[pBuffer->cursor++], p);
+            if (lua_istable(L, -1)) p = _writemsg(L, pBuffer, pPlan, p);
+            lua_pop(L, 1);
+        }
+        return p;
+    }
+
+    // field value at idx counts as set the way the encoder writes it, idx is absolute
+    static bool _present(lua_State *L, int idx, const FieldPlan* plan)
+    {
+        TypedArray* pArray;
+        WireValue v;
+
+        if (lua_isnil(L, idx)) return false;
+        if (plan->field->is_map())
+        {
+            if (!lua_istable(L, idx)) return false;
+            lua_pushnil(L);
+            if (lua_next(L, idx) == 0) return false;
+            lua_pop(L, 2);
+            return true;
+        }
+        if (plan->field->is_repeated())
+        {
+            pArray = _toarray(L, idx);
+            if (pArray) return pArray->count > 0;
+            return lua_istable(L, idx) && lua_rawlen(L, idx) > 0;
+        }
+        if (plan->sub) return lua_istable(L, idx);
+        return _checkscalar(L, idx, plan, &v);
+    }
+
+    static bool _samemsg(lua_State *L, int a, int b, const MessagePlan* pPlan);
+
+    // single values at absolute a and b encode the same
+    static bool _samesingle(lua_State *L, int a, int b, const FieldPlan* plan)
+    {
+        WireValue va, vb;
+        bool pa, pb;
+
+        if (plan->sub) return lua_istable(L, a) && lua_istable(L, b) ? _samemsg(L, a, b, plan->sub) : lua_istable(L, a) == lua_istable(L, b);
+
+        pa = _checkscalar(L, a, plan, &va);
+        pb = _checkscalar(L, b, plan, &vb);
+        if (pa != pb) return false;
+        if (!pa) return true;
+        switch (plan->field->cpp_type())
+        {
+            case google::protobuf::FieldDescriptor::CPPTYPE_STRING: return va.length == vb.length && memcmp(va.data, vb.data, va.length) == 0;
+            case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE: return memcmp(&va.d, &vb.d, sizeof(double)) == 0;
+            case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT: return memcmp(&va.f, &vb.f, sizeof(float)) == 0;
+            default: return va.u64 == vb.u64;
+        }
+    }
+
+    // element i of the array or typed array at absolute idx => top
+    static void _pusharrayelem(lua_State *L, int idx, TypedArray* pArray, size_t i)
+    {
+        if (pArray) _pusharrayat(L, pArray, i-1);
+        else lua_rawgeti(L, idx, i);
+    }
+
+    // present repeated or map values at absolute a and b encode the same
+    static bool _samerepeated(lua_State *L, int a, int b, const FieldPlan* plan)
+    {
+        const FieldPlan* kplan, *vplan;
+        TypedArray* pa, *pb;
+        size_t len, count = 0;
+        bool same = true;
+
+        if (plan->field->is_map())
+        {
+            _entryplans(plan, &kplan, &vplan);
+            lua_pushnil(L);
+            while (same && lua_next(L, a) != 0)
+            {
+                count++;
+                lua_pushvalue(L, -2);
+                same = lua_rawget(L, b) != LUA_TNIL && _samesingle(L, lua_gettop(L) - 1, lua_gettop(L), vplan);
+                lua_pop(L, 2);
+            }
+            if (!same)
+            {
+                lua_pop(L, 1);
+                return false;
+            }
+            lua_pushnil(L);
+            while (lua_next(L, b) != 0)
+            {
+                count--;
+                lua_pop(L, 1);
+            }
+            return count == 0;
+        }
+
+        pa = _toarray(L, a);
+        pb = _toarray(L, b);
+        len = pa ? pa->count : lua_rawlen(L, a);
+        if (len != (pb ? pb->count : lua_rawlen(L, b))) return false;
+        for (size_t i=1; same && i<=len; i++)
+        {
+            _pusharrayelem(L, a, pa, i);
+            _pusharrayelem(L, b, pb, i);
+            same = _samesingle(L, lua_gettop(L) - 1, lua_gettop(L), plan);
+            lua_pop(L, 2);
+        }
+        return same;
+    }
+
+    // tables at absolute a and b encode the same
+    static bool _samemsg(lua_State *L, int a, int b, const MessagePlan* pPlan)
+    {
+        bool same = true;
+        int keys, va, vb;
+
+        luaL_checkstack(L, 8, "message nested too deep!");
+        _pushkeys(L, pPlan);
+        keys = lua_gettop(L);
+        va = keys + 1;
+        vb = keys + 2;
+        for (size_t i=0; same && i<pPlan->fields.size(); i++)
+        {
+            auto plan = &pPlan->fields[i];
+            lua_rawgeti(L, keys, i+1);
+            lua_pushvalue(L, -1);
+            lua_rawget(L, a);
+            lua_insert(L, -2);
+            lua_rawget(L, b);                           //keys, a value, b value
+            bool pa = _present(L, va, plan), pb = _present(L, vb, plan);
+            if (pa != pb) same = false;
+            else if (pa) same = plan->field->is_repeated() ? _samerepeated(L, va, vb, plan) : _samesingle(L, va, vb, plan);
+            lua_settop(L, keys);
+        }
+        lua_pop(L, 1);
+        return same;
+    }
+
+    enum DeltaOp
+    {
+        DELTA_SAME,                         // left out
+        DELTA_FULL,                         // written whole, a delta replaces repeated fields
+        DELTA_SUB,                          // both sides are messages, written as their own delta
+        DELTA_CLEAR,                        // set before, listed in the DELTA_CLEARED field
+    };
+
+    // new and base values at absolute a and b => what the delta writes for the field
+    static DeltaOp _deltaop(lua_State *L, int a, int b, const FieldPlan* plan)
+    {
+        bool pa = _present(L, a, plan), pb = _present(L, b, plan);
+
+        if (!pa) return pb ? DELTA_CLEAR : DELTA_SAME;
+        if (!pb) return DELTA_FULL;
+        if (plan->field->is_repeated()) return _samerepeated(L, a, b, plan) ? DELTA_SAME : DELTA_FULL;
+        if (plan->sub && plan->field->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE) return DELTA_SUB;
+        return _samesingle(L, a, b, plan) ? DELTA_SAME : DELTA_FULL;
+    }
+
+    // new table at -2 and base table at -1 => size of the delta, ops and nested lengths are appended to pBuffer->sizes
+    // the first entry is the size of the cleared list, then one op per field, a DELTA_SUB op is followed by the sub delta size
+    static size_t _sizedelta(lua_State *L, EncodeBuffer* pBuffer, const MessagePlan* pPlan)
+    {
+        size_t size = 0, cleared = 0, head, slot, sub;
+        int t = lua_gettop(L) - 1, keys;
+
+        luaL_checkstack(L, 8, "message nested too deep!");
+        head = pBuffer->sizes.size();
+        pBuffer->sizes.push_back(0);
+        _pushkeys(L, pPlan);
+        keys = lua_gettop(L);
+
+        for (size_t i=0; i<pPlan->fields.size(); i++)
+        {
+            auto plan = &pPlan->fields[i];
+            lua_rawgeti(L, keys, i+1);
+            lua_pushvalue(L, -1);
+            lua_rawget(L, t);
+            lua_insert(L, -2);
+            lua_rawget(L, t+1);                         //keys, new, base
+
+            DeltaOp op = _deltaop(L, keys+1, keys+2, plan);
+            if (op == DELTA_SUB)
+            {
+                slot = pBuffer->sizes.size();
+                pBuffer->sizes.push_back(0);
+                pBuffer->sizes.push_back(0);
+                sub = _sizedelta(L, pBuffer, plan->sub);
+                if (sub == 0)
+                {
+                    pBuffer->sizes.resize(slot + 1);    //unchanged sub message, its entries are dropped
+                    op = DELTA_SAME;
+                }
+                else
+                {
+                    pBuffer->sizes[slot+1] = sub;
+                    if (plan->field->type() == google::protobuf::FieldDescriptor::TYPE_GROUP) size += _tagsize(plan) * 2 + sub;
+                    else size += _tagsize(plan) + google::protobuf::internal::WireFormatLite::LengthDelimitedSize(sub);
+                }
+                pBuffer->sizes[slot] = op;
+            }
+            else
+            {
+                pBuffer->sizes.push_back(op);
+                lua_pop(L, 1);
+                if (op == DELTA_FULL) size += _sizefield(L, pBuffer, plan);
+                if (op == DELTA_CLEAR) cleared += google::protobuf::io::CodedOutputStream::VarintSize32(plan->number);
+            }
+            lua_settop(L, keys);
+        }
+        lua_pop(L, 1);
+
+        pBuffer->sizes[head] = cleared;
+        if (cleared) size += google::protobuf::io::CodedOutputStream::VarintSize32(google::protobuf::internal::WireFormatLite::MakeTag(DELTA_CLEARED, google::protobuf::internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED))
+            + google::protobuf::internal::WireFormatLite::LengthDelimitedSize(cleared);
+        return size;
+    }
+
+    // new table at -2 and base table at -1 => bytes at p, replaying the ops of _sizedelta
+    // the cleared list goes first, so oneof members and replaced fields decoded after it stay
+    static google::protobuf::uint8* _writedelta(lua_State *L, EncodeBuffer* pBuffer, const MessagePlan* pPlan, google::protobuf::uint8* p)
+    {
+        typedef google::protobuf::io::CodedOutputStream O;
+        size_t cleared;
+        int t = lua_gettop(L) - 1, keys;
+
+        _pushkeys(L, pPlan);
+        keys = lua_gettop(L);
+        cleared = pBuffer->sizes[pBuffer->cursor++];
+        if (cleared)                                   //ops of nested deltas sit between the field ops, so presence is checked again
+        {
+            p = O::WriteTagToArray(google::protobuf::internal::WireFormatLite::MakeTag(DELTA_CLEARED, google::protobuf::internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED), p);
+            p = O::WriteVarint32ToArray((google::protobuf::uint32)cleared, p);
+            for (size_t i=0; i<pPlan->fields.size(); i++)
+            {
+                lua_rawgeti(L, keys, i+1);
+                lua_pushvalue(L, -1);
+                lua_rawget(L, t);
+                lua_insert(L, -2);
+                lua_rawget(L, t+1);
+                if (!_present(L, keys+1, &pPlan->fields[i]) && _present(L, keys+2, &pPlan->fields[i]))
+                    p = O::WriteVarint32ToArray((google::protobuf::uint32)pPlan->fields[i].number, p);
+                lua_settop(L, keys);
+            }
+        }
+
+        for (size_t i=0; i<pPlan->fields.size(); i++)
+        {
+            auto plan = &pPlan->fields[i];
+            DeltaOp op = (DeltaOp)pBuffer->sizes[pBuffer->cursor++];
+            if (op == DELTA_SAME || op == DELTA_CLEAR) continue;
+
+            lua_rawgeti(L, keys, i+1);
+            lua_pushvalue(L, -1);
+            lua_rawget(L, t);
+            if (op == DELTA_FULL)
+            {
+                p = _writefield(L, pBuffer, plan, p);
+            }
+            else
+            {
+                lua_insert(L, -2);
+                lua_rawget(L, t+1);                     //keys, new, base
+                if (plan->field->type() == google::protobuf::FieldDescriptor::TYPE_GROUP)
+                {
+                    pBuffer->cursor++;
+                    p = _writetag(plan, google::protobuf::internal::WireFormatLite::WIRETYPE_START_GROUP, p);
+                    p = _writedelta(L, pBuffer, plan->sub, p);
+                    p = _writetag(plan, google::protobuf::internal::WireFormatLite::WIRETYPE_END_GROUP, p);
+                }
+                else
+                {
+                    p = _writetag(plan, google::protobuf::internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED, p);
+                    p = O::WriteVarint32ToArray((google::protobuf::uint32)pBuffer->sizes[pBuffer->cursor++], p);
+                    p = _writedelta(L, pBuffer, plan->sub, p);
+                }
+            }
+            lua_settop(L, keys);
+        }
+        lua_pop(L, 1);
+        return p;
+    }
+
+    // lua table => binary data / callback(msg)
+    static int serialize(lua_State *L)
+    {
+        google::protobuf::Message* msg;
+        std::string data;
+
+        luaL_checkstring(L, 1);
+        msg = _newmsg(L, 1);
+        if (!msg) return 0;
+
+        if (lua_isfunction(L, -1))
+        {
+            lua_replace(L, 1);
+        }
+
+        MessagePtr ptr = _holdmsg(L, msg);    //below code may throw exception, so use unique_ptr to release memory
+        TypeStats* pStats = _typestats(L, msg->GetDescriptor());
+        google::protobuf::uint64 start = pStats ? _now() : 0;
+
+        _table2msg(L, msg);
+        if (pStats)
+        {
+            pStats->encodes++;
+            pStats->tablens += _now() - start;
+        }
+
+        if (lua_isfunction(L, 1))
+        {
+            lua_settop(L, 1);
+            lua_pushlightuserdata(L, (void*)msg);
+            lua_call(L, 1, 0);
+            return 0;
+        }
+        else
+        {
+            if (pStats) start = _now();
+            msg->SerializeToString(&data);
+            if (pStats)
+            {
+                pStats->wirens += _now() - start;
+                pStats->bytesout += data.length();
+            }
+            lua_pushlstring(L, data.c_str(), data.length());
+            return 1;
+        }
+    }
+
+    // lua table => binary data in a caller owned lightuserdata buffer
+    // returns the encoded size, snprintf style: nothing is written when it is larger than cap
+    static int serialize_into(lua_State *L)
+    {
+        google::protobuf::Message* msg;
+        void* ptr;
+        size_t cap, sz;
+
+        luaL_checkstring(L, 1);
+        ptr = lua_touserdata(L, 3);
+        luaL_argcheck(L, ptr != nullptr, 3, "buffer expected");
+        luaL_argcheck(L, luaL_checkinteger(L, 4) >= 0, 4, "size must not be negative");
+        cap = (size_t)lua_tointeger(L, 4);
+
+        msg = _newmsg(L, 1);
+        if (!msg) return 0;
+
+        MessagePtr holder = _holdmsg(L, msg);    //below code may throw exception, so use unique_ptr to release memory
+        TypeStats* pStats = _typestats(L, msg->GetDescriptor());
+        google::protobuf::uint64 start = pStats ? _now() : 0, mid = 0;
+
+        lua_settop(L, 2);
+        _table2msg(L, msg);
+        if (pStats) mid = _now();
+
+        sz = msg->ByteSizeLong();
+        if (sz <= cap) msg->SerializeWithCachedSizesToArray((google::protobuf::uint8*)ptr);
+        if (pStats)
+        {
+            pStats->encodes++;
+            pStats->tablens += mid - start;
+            pStats->wirens += _now() - mid;
+            if (sz <= cap) pStats->bytesout += sz;
+        }
+
+        lua_pushinteger(L, sz);
+        return 1;
+    }
+
+    // "a.b.c" => mask table at mask, selecting the last field whole
+    static void _addmaskpath(lua_State *L, int mask, const MessagePlan* pPlan, const char* path)
+    {
+        const char* p = path;
+        int top = lua_gettop(L);
+
+        lua_pushvalue(L, mask);
+        while (true)
+        {
+            const char* dot = strchr(p, '.');
+            std::string name = dot ? std::string(p, dot - p) : std::string(p);
+            auto field = pPlan->descriptor->FindFieldByName(name);
+            if (field == nullptr) luaL_error(L, "invalid field %s!", path);
+
+            if (dot == nullptr)
+            {
+                lua_pushboolean(L, 1);
+                lua_rawseti(L, -2, field->index()+1);
+                break;
+            }
+
+            auto plan = &pPlan->fields[field->index()];
+            if (plan->sub == nullptr || field->is_map()) luaL_error(L, "invalid field %s!", path);
+
+            auto type = lua_rawgeti(L, -1, field->index()+1);
+            if (type == LUA_TBOOLEAN) break;            //already selected whole
+            if (type != LUA_TTABLE)
+            {
+                lua_pop(L, 1);
+                lua_newtable(L);
+                lua_pushvalue(L, -1);
+                lua_rawseti(L, -3, field->index()+1);
+            }
+            lua_remove(L, -2);
+            pPlan = plan->sub;
+            p = dot + 1;
+        }
+        lua_settop(L, top);
+    }
+
+    // field paths, a list {"a.b", "c"} or a set {["a.b"] = true}, at idx => mask at top
+    // mask[index+1] is true for a field selected whole, or the mask of a sub message, mask[0] is the descriptor
+    static void _compilemask(lua_State *L, int idx, const MessagePlan* pPlan)
+    {
+        int mask;
+
+        lua_newtable(L);
+        mask = lua_gettop(L);
+        lua_pushlightuserdata(L, (void*)pPlan->descriptor);
+        lua_rawseti(L, mask, 0);
+
+        lua_pushnil(L);
+        while (lua_next(L, idx) != 0)
+        {
+            int path = lua_type(L, -2) == LUA_TSTRING ? -2 : -1;
+            if (path == -2 && !lua_toboolean(L, -1))
+            {
+                lua_pop(L, 1);
+                continue;
+            }
+            if (lua_type(L, path) != LUA_TSTRING) luaL_error(L, "field path expected, got %s!", luaL_typename(L, path));
+            _addmaskpath(L, mask, pPlan, lua_tostring(L, path));
+            lua_pop(L, 1);
+        }
+    }
+
+    // paths at idx => cache key at top: the descriptor followed by the sorted paths, so equal path sets share one mask
+    // whatever table they come in, and a table changed by the caller gets the mask of its new contents
+    static void _pushmaskkey(lua_State *L, int idx, const MessagePlan* pPlan)
+    {
+        bool valid = true;
+        {
+            std::vector<std::string> paths;
+            std::string key((const char*)&pPlan->descriptor, sizeof(pPlan->descriptor));
+
+            lua_pushnil(L);
+            while (lua_next(L, idx) != 0)
+            {
+                int path = lua_type(L, -2) == LUA_TSTRING ? -2 : -1;
+                if (path == -1 || lua_toboolean(L, -1))
+                {
+                    if (lua_type(L, path) != LUA_TSTRING)
+                    {
+                        valid = false;
+                        lua_pop(L, 2);
+                        break;
+                    }
+                    size_t len;
+                    const char* p = lua_tolstring(L, path, &len);
+                    paths.push_back(std::string(p, len));
+                }
+                lua_pop(L, 1);
+            }
+            std::sort(paths.begin(), paths.end());
+            for (auto& path : paths)
+            {
+                key.push_back('\0');
+                key.append(path);
+            }
+            if (valid) lua_pushlstring(L, key.data(), key.length());
+        }
+        if (!valid) _compilemask(L, idx, pPlan);        //raises the field path error, after the strings above are gone
+    }
+
+    // compiled mask for the paths at idx => top, cached by path set in the weak valued upvalue
+    static void _getmask(lua_State *L, int idx, const MessagePlan* pPlan)
+    {
+        _pushmaskkey(L, idx, pPlan);
+        lua_pushvalue(L, -1);
+        if (lua_rawget(L, lua_upvalueindex(8)) == LUA_TTABLE)
+        {
+            lua_remove(L, -2);
+            return;
+        }
+        lua_pop(L, 1);
+
+        _compilemask(L, idx, pPlan);
+        lua_insert(L, -2);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, lua_upvalueindex(8));
+    }
+
+    static void _countdecode(TypeStats* pStats, size_t size, google::protobuf::uint64 tablens, google::protobuf::uint64 wirens)
+    {
+        pStats->decodes++;
+        pStats->bytesin += size;
+        pStats->tablens += tablens;
+        pStats->wirens += wirens;
+    }
+
+    // strict mode: nullptr when data of size sz may be decoded from input, otherwise the reason
+    static const char* _strictinput(CodecState* pState, google::protobuf::io::CodedInputStream* input, size_t sz)
+    {
+        pState->failure = nullptr;
+        pState->entries.clear();                            //left over by a decode that failed
+        if (pState->maxsize > 0 && sz > pState->maxsize) return "message too large";
+        if (pState->maxdepth > 0) input->SetRecursionLimit(pState->maxdepth);
+        return nullptr;
+    }
+
+    // strict mode: wire fields of pPlan up to endtag => reason when a repeated field holds more than max elements
+    // counted before the reflection parse builds anything, counts has a slot per field of each open message
+    static const char* _scanrepeated(google::protobuf::io::CodedInputStream* input, const MessagePlan* pPlan, google::protobuf::uint32 endtag, size_t max, std::vector<size_t>* counts)
+    {
+        typedef google::protobuf::internal::WireFormatLite W;
+        google::protobuf::uint32 tag, length;
+        const char* reason = nullptr;
+        size_t base = counts->size();
+
+        counts->resize(base + pPlan->fields.size());
+        while (reason == nullptr && (tag = input->ReadTag()) != 0 && tag != endtag)
+        {
+            auto wiretype = W::GetTagWireType(tag);
+            auto plan = _findfield(pPlan, W::GetTagFieldNumber(tag));
+            auto field = plan ? plan->field : nullptr;
+            bool sub = plan && plan->sub && wiretype == (field->type() == google::protobuf::FieldDescriptor::TYPE_GROUP ? W::WIRETYPE_START_GROUP : W::WIRETYPE_LENGTH_DELIMITED);
+
+            if (field && field->is_repeated() && ++(*counts)[base + field->index()] > max) return "too many repeated elements";
+            if (sub)
+            {
+                if (!input->IncrementRecursionDepth()) return "malformed message";
+                if (wiretype == W::WIRETYPE_START_GROUP)
+                {
+                    reason = _scanrepeated(input, plan->sub, W::MakeTag(plan->number, W::WIRETYPE_END_GROUP), max, counts);
+                }
+                else if (_readlength(input, &length))
+                {
+                    auto limit = input->PushLimit(length);
+                    reason = _scanrepeated(input, plan->sub, 0, max, counts);
+                    if (reason == nullptr && !input->ConsumedEntireMessage()) reason = "malformed message";
+                    input->PopLimit(limit);
+                }
+                else reason = "malformed message";
+                input->DecrementRecursionDepth();
+            }
+            else if (field && field->is_packable() && wiretype == W::WIRETYPE_LENGTH_DELIMITED)
+            {
+                auto elemtype = W::WireTypeForFieldType((W::FieldType)field->type());
+                size_t n = 0;
+                if (!_readlength(input, &length)) return "malformed message";
+                if (elemtype == W::WIRETYPE_FIXED32 || elemtype == W::WIRETYPE_FIXED64)
+                {
+                    n = length / (elemtype == W::WIRETYPE_FIXED32 ? 4 : 8);
+                    if (!input->Skip(length)) return "malformed message";
+                }
+                else
+                {
+                    google::protobuf::uint64 value;
+                    auto limit = input->PushLimit(length);
+                    while (input->BytesUntilLimit() > 0)
+                    {
+                        if (!input->ReadVarint64(&value)) return "malformed message";
+                        n++;
+                    }
+                    input->PopLimit(limit);
+                }
+                if (n > 0) (*counts)[base + field->index()] += n - 1;   //the tag counted one
+                if ((*counts)[base + field->index()] > max) return "too many repeated elements";
+            }
+            else if (!W::SkipField(input, tag)) return "malformed message";
+        }
+        counts->resize(base);
+        return reason;
+    }
+
+    // strict mode: data => msg within the limits, otherwise the reason, the names of missing required fields in *missing
+    // repeated fields are counted by a _scanrepeated pass over the wire first, since the parse itself has no hook for it;
+    // that pass only runs with maxrepeated set, the other checks happen before any table is built for the message
+    // touches no lua_State, so deserialize_async runs it on its worker
+    static const char* _strictcheck(google::protobuf::Message* msg, const MessagePlan* pPlan, const void* data, size_t sz, int maxdepth, size_t maxsize, size_t maxrepeated, std::string* missing)
+    {
+        google::protobuf::io::CodedInputStream input((const google::protobuf::uint8*)data, sz);
+        const char* reason = nullptr;
+
+        if (maxsize > 0 && sz > maxsize) return "message too large";
+        if (maxdepth > 0) input.SetRecursionLimit(maxdepth);
+        if (maxrepeated > 0)
+        {
+            google::protobuf::io::CodedInputStream scan((const google::protobuf::uint8*)data, sz);
+            std::vector<size_t> counts;
+            if (maxdepth > 0) scan.SetRecursionLimit(maxdepth);
+            if ((reason = _scanrepeated(&scan, pPlan, 0, maxrepeated, &counts))) return reason;
+        }
+        if (!msg->ParsePartialFromCodedStream(&input) || !input.ConsumedEntireMessage()) return "malformed message";
+        if (!msg->IsInitialized())
+        {
+            *missing = msg->InitializationErrorString();
+            return "missing required fields";
+        }
+        return nullptr;
+    }
+
+    // strict mode: data => msg, otherwise false with nil, reason pushed
+    static bool _strictparse(lua_State *L, CodecState* pState, google::protobuf::Message* msg, const void* data, size_t sz)
+    {
+        std::string missing;
+        const char* reason = _strictcheck(msg, _getplan(L, msg->GetDescriptor()), data, sz, pState->maxdepth, pState->maxsize, pState->maxrepeated, &missing);
+
+        if (reason == nullptr) return true;
+        lua_pushnil(L);
+        if (missing.empty()) lua_pushstring(L, reason);
+        else lua_pushfstring(L, "%s: %s", reason, missing.c_str());
+        return false;
+    }
+
+    // strict wire decodes: a required field missing from the table at idx or from its sub tables, nullptr when none
+    // fields the mask at index mask leaves out are not checked
+    static const google::protobuf::FieldDescriptor* _checkrequired(lua_State *L, int idx, const MessagePlan* pPlan, int mask)
+    {
+        const google::protobuf::FieldDescriptor* missing = nullptr;
+        int keys, submask;
+
+        luaL_checkstack(L, 8, "message nested too deep!");
+        _pushkeys(L, pPlan);
+        keys = lua_gettop(L);
+
+        for (size_t i=0; missing == nullptr && i<pPlan->fields.size(); i++)
+        {
+            auto plan = &pPlan->fields[i];
+            bool sub = plan->sub && plan->sub->required;
+            if (!sub && !plan->field->is_required()) continue;
+
+            submask = 0;
+            if (mask != 0)
+            {
+                int type = lua_rawgeti(L, mask, i+1);
+                if (type == LUA_TNIL)
+                {
+                    lua_settop(L, keys);
+                    continue;
+                }
+                if (type == LUA_TTABLE) submask = keys + 1;
+            }
+            lua_rawgeti(L, keys, i+1);
+            int value = lua_gettop(L);
+            if (lua_rawget(L, idx) == LUA_TNIL)
+            {
+                if (plan->field->is_required()) missing = plan->field;
+            }
+            else if (sub && !plan->field->is_repeated())
+            {
+                missing = _checkrequired(L, value, plan->sub, submask);
+            }
+            else if (sub && plan->field->is_map())
+            {
+                auto vplan = &plan->sub->fields[1];
+                lua_pushnil(L);
+                while (missing == nullptr && lua_next(L, value))
+                {
+                    if (vplan->sub) missing = _checkrequired(L, value+2, vplan->sub, 0);
+                    lua_pop(L, 1);
+                }
+            }
+            else if (sub)
+            {
+                for (lua_Integer j=1; missing == nullptr && lua_rawgeti(L, value, j) == LUA_TTABLE; j++)
+                {
+                    missing = _checkrequired(L, value+1, plan->sub, submask);
+                    lua_pop(L, 1);
+                }
+            }
+            lua_settop(L, keys);
+        }
+        lua_pop(L, 1);
+        return missing;
+    }
+
+    // strict mode: nil, reason for a required field _checkrequired found missing
+    static int _requiredfail(lua_State *L, const google::protobuf::FieldDescriptor* field)
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "missing required fields: %s", field->full_name().c_str());
+        return 2;
+    }
+
+    // strict mode: nil, reason of a failed wire decode
+    static int _strictfail(lua_State *L, CodecState* pState, const char* reason)
+    {
+        lua_pushnil(L);
+        lua_pushstring(L, reason ? reason : pState->failure ? pState->failure : "malformed message");
+        return 2;
+    }
+
+    // binary data / lightuserdata => lua table / callback(tbl)
+    // in the callback form bytes fields can be views over the message, see option("bytesview")
+    // deserialize(name, data, fields) decodes only the fields on the given paths, skipping the rest on the wire
+    // with option("strict") malformed data, missing required fields or a broken limit return nil, reason instead
+    static int deserialize(lua_State *L)
+    {
+        google::protobuf::Message* msg;
+        const google::protobuf::FieldDescriptor* missing;
+        CodecState* pState;
+        const void* data;
+        size_t sz;
+        int fn, top;
+        bool ok;
+
+        luaL_checkstring(L, 1);
+        pState = _getstate(L);
+        if (lua_isuserdata(L, 2))
+        {
+            data = (const void*)lua_touserdata(L, 2);
+            sz = luaL_checkinteger(L, 3);
+            fn = 4;
+        }
+        else
+        {
+            data = luaL_checklstring(L, 2, &sz);
+            fn = 3;
+        }
+
+        if (lua_istable(L, fn))
+        {
+            const google::protobuf::Message* pMessage = _getprototype(L, 1);
+            if (!pMessage) return 0;
+            const MessagePlan* pPlan = _getplan(L, pMessage->GetDescriptor());
+
+            TypeStats* pStats = _typestats(L, pPlan->descriptor);
+            google::protobuf::uint64 start = pStats ? _now() : 0;
+
+            lua_settop(L, fn);
+            _getmask(L, fn, pPlan);
+            google::protobuf::io::CodedInputStream input((const google::protobuf::uint8*)data, sz);
+            const char* reason = pState->strict ? _strictinput(pState, &input, sz) : nullptr;
+            if (reason) return _strictfail(L, pState, reason);
+
+            lua_newtable(L);
+            top = lua_gettop(L);
+            ok = _decodemsg(L, &input, pPlan, 0, fn+1) && input.ConsumedEntireMessage();   //a cut tag just ends the loop
+            if (!ok && pState->strict) return _strictfail(L, pState, nullptr);
+            lua_settop(L, top);
+            if (pState->strict && pPlan->required && (missing = _checkrequired(L, top, pPlan, fn+1))) return _requiredfail(L, missing);
+            if (pStats) _countdecode(pStats, sz, _now() - start, 0);
+            return 1;
+        }
+
+        msg = _newmsg(L, 1);
+        if (!msg) return 0;
+        MessagePtr ptr = _holdmsg(L, msg);    //below code may throw exception, so use unique_ptr to release memory
+        TypeStats* pStats = _typestats(L, msg->GetDescriptor());
+        google::protobuf::uint64 start = pStats ? _now() : 0, mid = 0;
+
+        if (!pState->strict) msg->ParseFromArray(data, sz);
+        else if (!_strictparse(L, pState, msg, data, sz)) return 2;
+        if (pStats) mid = _now();
+        _dropoffer(L);
+
+        if (lua_isfunction(L, fn))
+        {
+            struct ViewGuard
+            {
+                CodecState* pState;
+                bool viewing;
+                ~ViewGuard() { pState->viewing = viewing; }
+            };
+
+            lua_settop(L, fn);
+            {
+                ViewGuard guard = {pState, pState->viewing};
+                pState->viewing = pState->bytesview > 0;
+                _msg2table(L, msg);
+            }
+            if (pStats) _countdecode(pStats, sz, _now() - mid, mid - start);
+            lua_call(L, 1, LUA_MULTRET);          //views stay valid until the callback returns
+            return lua_gettop(L) - fn + 1;
+        }
+
+        _msg2table(L, msg);
+        if (pStats) _countdecode(pStats, sz, _now() - mid, mid - start);
+
+        return 1;
+    }
+
+    // deserialize_into(name, data | ptr, sz, tbl) => tbl refilled in place
+    // nested tables and arrays of tbl are reused, arrays are truncated and fields absent from the data become nil
+    static int deserialize_into(lua_State *L)
+    {
+        google::protobuf::Message* msg;
+        const void* data;
+        size_t sz;
+        int t;
+
+        luaL_checkstring(L, 1);
+        if (lua_isuserdata(L, 2))
+        {
+            data = (const void*)lua_touserdata(L, 2);
+            sz = luaL_checkinteger(L, 3);
+            t = 4;
+        }
+        else
+        {
+            data = luaL_checklstring(L, 2, &sz);
+            t = 3;
+        }
+        luaL_checktype(L, t, LUA_TTABLE);
+
+        msg = _newmsg(L, 1);
+        if (!msg) return 0;
+        MessagePtr ptr = _holdmsg(L, msg);
+        CodecState* pState = _getstate(L);
+        TypeStats* pStats = _typestats(L, msg->GetDescriptor());
+        google::protobuf::uint64 start = pStats ? _now() : 0, mid = 0;
+
+        if (!pState->strict) msg->ParseFromArray(data, sz);
+        else if (!_strictparse(L, pState, msg, data, sz)) return 2;
+        if (pStats) mid = _now();
+
+        struct OfferGuard
+        {
+            lua_State *L;
+            ~OfferGuard() { _dropoffer(L); }
+        } guard = {L};
+
+        lua_settop(L, t);
+        _offertable(L, t);
+        _msg2table(L, msg);
+        if (pStats) _countdecode(pStats, sz, _now() - mid, mid - start);
+        return 1;
+    }
+
+    // lua table => binary data / callback(ptr, sz), encoded straight into the per lua_State buffer
+    static int encode(lua_State *L)
+    {
+        const google::protobuf::Message* pMessage;
+        CodecState* pState;
+        EncodeBuffer local, *pBuffer;
+
+        luaL_checkstring(L, 1);
+        pMessage = _getprototype(L, 1);
+        if (!pMessage) return 0;
+
+        pState = _getstate(L);
+        pBuffer = pState->encoder.busy ? &local : &pState->encoder;   //nested call from an encode callback
+        TypeStats* pStats = _typestats(L, pMessage->GetDescriptor());
+        google::protobuf::uint64 start = pStats ? _now() : 0;
+
+        lua_settop(L, 3);
+        lua_pushvalue(L, 2);
+        _encode(L, pBuffer, _getplan(L, pMessage->GetDescriptor()));
+        lua_pop(L, 1);
+        if (pStats)
+        {
+            pStats->encodes++;
+            pStats->bytesout += pBuffer->data.size();
+            pStats->tablens += _now() - start;
+        }
+
+        if (lua_isfunction(L, 3))
+        {
+            struct BusyGuard
+            {
+                EncodeBuffer* pBuffer;
+                ~BusyGuard() { pBuffer->busy = false; }
+            } guard = {pBuffer};
+
+            pBuffer->busy = true;
+            lua_pushlightuserdata(L, (void*)pBuffer->data.data());
+            lua_pushinteger(L, pBuffer->data.size());
+            lua_call(L, 2, 0);
+            return 0;
+        }
+
+        lua_pushlstring(L, pBuffer->data.data(), pBuffer->data.size());
+        return 1;
+    }
+
+    // binary data / lightuserdata => lua table, decoded straight from the wire format
+    // with option("strict") it returns nil, reason in the same cases as deserialize
+    static int decode(lua_State *L)
+    {
+        const google::protobuf::Message* pMessage;
+        const google::protobuf::FieldDescriptor* missing;
+        const void* data;
+        size_t sz;
+        int top;
+
+        luaL_checkstring(L, 1);
+        if (lua_isuserdata(L, 2))
+        {
+            data = (const void*)lua_touserdata(L, 2);
+            sz = luaL_checkinteger(L, 3);
+        }
+        else
+        {
+            data = luaL_checklstring(L, 2, &sz);
+        }
+
+        pMessage = _getprototype(L, 1);
+        if (!pMessage) return 0;
+
+        CodecState* pState = _getstate(L);
+        TypeStats* pStats = _typestats(L, pMessage->GetDescriptor());
+        google::protobuf::uint64 start = pStats ? _now() : 0;
+        google::protobuf::io::CodedInputStream input((const google::protobuf::uint8*)data, sz);
+        const char* reason = pState->strict ? _strictinput(pState, &input, sz) : nullptr;
+        if (reason) return _strictfail(L, pState, reason);
+
+        const MessagePlan* pPlan = _getplan(L, pMessage->GetDescriptor());
+        lua_newtable(L);
+        top = lua_gettop(L);
+        bool ok = _decodemsg(L, &input, pPlan, 0) && input.ConsumedEntireMessage();
+        if (!ok && pState->strict) return _strictfail(L, pState, nullptr);
+        lua_settop(L, top);
+        if (pState->strict && pPlan->required && (missing = _checkrequired(L, top, pPlan, 0))) return _requiredfail(L, missing);
+        if (pStats) _countdecode(pStats, sz, _now() - start, 0);
+        return 1;
+    }
+
+    // lua table + baseline table => binary data holding only the fields that differ, nil baseline is an empty message
+    static int serialize_delta(lua_State *L)
+    {
+        const google::protobuf::Message* pMessage;
+        const MessagePlan* pPlan;
+        CodecState* pState;
+        EncodeBuffer local, *pBuffer;
+        google::protobuf::uint8* p;
+        size_t size;
+
+        luaL_checkstring(L, 1);
+        luaL_checktype(L, 2, LUA_TTABLE);
+        if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TTABLE);
+
+        pMessage = _getprototype(L, 1);
+        if (!pMessage) return 0;
+        pPlan = _getplan(L, pMessage->GetDescriptor());
+
+        pState = _getstate(L);
+        pBuffer = pState->encoder.busy ? &local : &pState->encoder;   //nested call from an encode callback
+        TypeStats* pStats = _typestats(L, pPlan->descriptor);
+        google::protobuf::uint64 start = pStats ? _now() : 0;
+
+        lua_settop(L, 3);
+        if (lua_isnil(L, 3))
+        {
+            lua_newtable(L);
+            lua_replace(L, 3);
+        }
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, 3);
+
+        pBuffer->sizes.clear();
+        pBuffer->cursor = 0;
+        size = _sizedelta(L, pBuffer, pPlan);
+        if (pBuffer->data.capacity() > ENCODE_BUFFER_RETAIN && size <= ENCODE_BUFFER_RETAIN) std::string().swap(pBuffer->data);
+        pBuffer->data.resize(size);
+        if (size > 0)
+        {
+            p = _writedelta(L, pBuffer, pPlan, (google::protobuf::uint8*)&pBuffer->data[0]);
+            if (p != (google::protobuf::uint8*)&pBuffer->data[0] + size) luaL_error(L, "table changed while encoding!");
+        }
+        if (pStats)
+        {
+            pStats->encodes++;
+            pStats->bytesout += size;
+            pStats->tablens += _now() - start;
+        }
+
+        lua_pushlstring(L, pBuffer->data.data(), pBuffer->data.size());
+        return 1;
+    }
+
+    // lua table + serialize_delta output => the same table updated in place
+    // an invalid or cut delta raises an error, the fields before the bad spot are already applied by then
+    static int apply_delta(lua_State *L)
+    {
+        const google::protobuf::Message* pMessage;
+        CodecState* pState;
+        const void* data;
+        size_t sz;
+        bool ok;
+
+        luaL_checkstring(L, 1);
+        luaL_checktype(L, 2, LUA_TTABLE);
+        if (lua_isuserdata(L, 3))
+        {
+            data = (const void*)lua_touserdata(L, 3);
+            sz = luaL_checkinteger(L, 4);
+        }
+        else
+        {
+            data = luaL_checklstring(L, 3, &sz);
+        }
+
+        pMessage = _getprototype(L, 1);
+        if (!pMessage) return 0;
+
+        pState = _getstate(L);
+        TypeStats* pStats = _typestats(L, pMessage->GetDescriptor());
+        google::protobuf::uint64 start = pStats ? _now() : 0;
+        {
+            struct DeltaGuard
+            {
+                CodecState* pState;
+                ~DeltaGuard() { pState->delta = false; }
+            } guard = {pState};
+
+            pState->delta = true;
+            google::protobuf::io::CodedInputStream input((const google::protobuf::uint8*)data, sz);
+
+            lua_settop(L, 2);
+            pState->entries.clear();
+            ok = _decodemsg(L, &input, _getplan(L, pMessage->GetDescriptor()), 0) && input.ConsumedEntireMessage();   //a cut tag just ends the loop
+            lua_settop(L, 2);
+        }
+        if (!ok) luaL_error(L, "invalid delta for %s!", luaL_checkstring(L, 1));
+        if (pStats) _countdecode(pStats, sz, _now() - start, 0);
+        return 1;
+    }
+
+    // array of lua tables => varint length delimited records as binary data
+    // with a lightuserdata buffer returns the total size, snprintf style like serialize_into
+    static int serialize_batch(lua_State *L)
+    {
+        const google::protobuf::Message* pMessage;
+        const MessagePlan* pPlan;
+        CodecState* pState;
+        EncodeBuffer local, *pBuffer;
+        google::protobuf::uint8 *ptr, *p;
+        size_t size, cap;
+
+        luaL_checkstring(L, 1);
+        luaL_checktype(L, 2, LUA_TTABLE);
+        ptr = (google::protobuf::uint8*)lua_touserdata(L, 3);
+        if (ptr) luaL_argcheck(L, luaL_checkinteger(L, 4) >= 0, 4, "size must not be negative");
+        cap = ptr ? (size_t)lua_tointeger(L, 4) : 0;
+
+        pMessage = _getprototype(L, 1);
+        if (!pMessage) return 0;
+        pPlan = _getplan(L, pMessage->GetDescriptor());
+
+        pState = _getstate(L);
+        pBuffer = pState->encoder.busy ? &local : &pState->encoder;   //nested call from an encode callback
+        TypeStats* pStats = _typestats(L, pPlan->descriptor);
+        google::protobuf::uint64 start = pStats ? _now() : 0;
+
+        lua_settop(L, 2);
+        size = _sizebatch(L, pBuffer, pPlan, 2);
+
+        if (ptr)
+        {
+            if (size <= cap)
+            {
+                p = _writebatch(L, pBuffer, pPlan, 2, ptr);
+                if (p != ptr + size) luaL_error(L, "table changed while encoding!");
+                if (pStats)
+                {
+                    pStats->encodes += lua_rawlen(L, 2);
+                    pStats->bytesout += size;
+                    pStats->tablens += _now() - start;
+                }
+            }
+            lua_pushinteger(L, size);
+            return 1;
+        }
+
+        if (pBuffer->data.capacity() > ENCODE_BUFFER_RETAIN && size <= ENCODE_BUFFER_RETAIN) std::string().swap(pBuffer->data);
+        pBuffer->data.resize(size);
+        if (size > 0)
+        {
+            ptr = (google::protobuf::uint8*)&pBuffer->data[0];
+            p = _writebatch(L, pBuffer, pPlan, 2, ptr);
+            if (p != ptr + size) luaL_error(L, "table changed while encoding!");
+        }
+        if (pStats)
+        {
+            pStats->encodes += lua_rawlen(L, 2);
+            pStats->bytesout += size;
+            pStats->tablens += _now() - start;
+        }
+        lua_pushlstring(L, pBuffer->data.data(), pBuffer->data.size());
+        return 1;
+    }
+
+    // varint length delimited records of one type => array of lua tables, bytes consumed
+    // stops after count records, at the end of the data, or before a truncated or malformed record
+    // with option("strict") a malformed record, one breaking a limit or missing required fields gives nil, reason instead
+    // maxsize then applies to each record, a truncated last record still just ends the batch
+    static int deserialize_batch(lua_State *L)
+    {
+        const google::protobuf::Message* pMessage;
+        const google::protobuf::FieldDescriptor* missing;
+        const MessagePlan* pPlan;
+        CodecState* pState;
+        const void* data;
+        size_t sz;
+        lua_Integer count, n;
+        google::protobuf::uint32 length;
+        size_t consumed;
+        int top;
+
+        luaL_checkstring(L, 1);
+        if (lua_isuserdata(L, 2))
+        {
+            data = (const void*)lua_touserdata(L, 2);
+            sz = luaL_checkinteger(L, 3);
+            count = luaL_optinteger(L, 4, -1);
+        }
+        else
+        {
+            data = luaL_checklstring(L, 2, &sz);
+            count = luaL_optinteger(L, 3, -1);
+        }
+
+        pMessage = _getprototype(L, 1);
+        if (!pMessage) return 0;
+        pPlan = _getplan(L, pMessage->GetDescriptor());
+
+        pState = _getstate(L);
+        TypeStats* pStats = _typestats(L, pPlan->descriptor);
+        google::protobuf::uint64 start = pStats ? _now() : 0;
+        google::protobuf::io::CodedInputStream input((const google::protobuf::uint8*)data, sz);
+        if (pState->strict) _strictinput(pState, &input, 0);
+
+        lua_newtable(L);
+        top = lua_gettop(L);
+        consumed = 0;
+        for (n = 0; n != count && !input.ExpectAtEnd(); n++)
+        {
+            if (!input.ReadVarint32(&length) || length > sz - input.CurrentPosition()) break;
+            if (pState->strict && pState->maxsize > 0 && length > pState->maxsize) return _strictfail(L, pState, "message too large");
+
+            auto limit = input.PushLimit(length);
+            lua_newtable(L);
+            if (!_decodemsg(L, &input, pPlan, 0) || !input.ConsumedEntireMessage())
+            {
+                if (pState->strict) return _strictfail(L, pState, nullptr);
+                break;
+            }
+            input.PopLimit(limit);
+            lua_settop(L, top + 1);
+            if (pState->strict && pPlan->required && (missing = _checkrequired(L, top + 1, pPlan, 0))) return _requiredfail(L, missing);
+            lua_rawseti(L, top, n + 1);
+            consumed = input.CurrentPosition();
+        }
+        if (pStats)
+        {
+            pStats->decodes += n;
+            pStats->bytesin += consumed;
+            pStats->tablens += _now() - start;
+        }
+        lua_settop(L, top);
+        lua_pushinteger(L, consumed);
+        return 2;
+    }
+
+    // decoder(name) => stream decoder with :feed(data | ptr, sz) and :finish()
+    static int decoder(lua_State *L)
+    {
+        const google::protobuf::Message* pMessage;
+        StreamDecoder* pDecoder;
+
+        luaL_checkstring(L, 1);
+        pMessage = _getprototype(L, 1);
+        if (!pMessage) return 0;
+
+        pDecoder = new (lua_newuserdata(L, sizeof(StreamDecoder))) StreamDecoder();
+        pDecoder->plan = _getplan(L, pMessage->GetDescriptor());
+        pDecoder->need = 0;
+        pDecoder->fed = 0;
+        pDecoder->tablens = 0;
+        pDecoder->failed = false;
+        pDecoder->failure = nullptr;
+        lua_pushvalue(L, lua_upvalueindex(6));
+        lua_setmetatable(L, -2);
+        lua_newtable(L);
+        lua_setuservalue(L, -2);
+        return 1;
+    }
+
+    // userdata at idx with the metatable kept in upvalue mt
+    static void* _checkobject(lua_State *L, int idx, int mt, const char* name)
+    {
+        void* p = lua_touserdata(L, idx);
+
+        if (p == nullptr || !lua_getmetatable(L, idx)) luaL_argerror(L, idx, name);
+        if (!lua_rawequal(L, -1, lua_upvalueindex(mt))) luaL_argerror(L, idx, name);
+        lua_pop(L, 1);
+        return p;
+    }
+
+    static StreamDecoder* _checkdecoder(lua_State *L)
+    {
+        return (StreamDecoder*)_checkobject(L, 1, 6, "decoder expected");
+    }
+
+    static int _decodergc(lua_State *L)
+    {
+        StreamDecoder* pDecoder = (StreamDecoder*)lua_touserdata(L, 1);
+        pDecoder->~StreamDecoder();
+        return 0;
+    }
+
+    // varint at p + *pos => 1 and the position after it, 0 when it runs past n, -1 when it is longer than 10 bytes
+    static int _peekvarint(const google::protobuf::uint8* p, size_t n, size_t* pos, google::protobuf::uint64* value)
+    {
+        google::protobuf::uint64 v = 0;
+
+        for (size_t i=0; i<10; i++)
+        {
+            if (*pos + i >= n) return 0;
+            v |= (google::protobuf::uint64)(p[*pos + i] & 0x7f) << (7 * i);
+            if (p[*pos + i] < 0x80)
+            {
+                *pos += i + 1;
+                *value = v;
+                return 1;
+            }
+        }
+        return -1;
+    }
+
+    // top level field starting at p with n bytes at hand => 1 and its full size once the header is complete,
+    // 0 when more bytes are needed, -1 when it is malformed (a zero tag included)
+    // a group carries no length, it is only sized once its end tag has arrived, by skipping it from the start
+    static int _fieldsize(const google::protobuf::uint8* p, size_t n, size_t* size)
+    {
+        typedef google::protobuf::internal::WireFormatLite W;
+        google::protobuf::uint64 tag, value;
+        size_t pos = 0;
+        int r;
+
+        if ((r = _peekvarint(p, n, &pos, &tag)) <= 0) return r;
+        if (tag > 0xffffffffu || W::GetTagFieldNumber((google::protobuf::uint32)tag) == 0) return -1;
+
+        switch (W::GetTagWireType((google::protobuf::uint32)tag))
+        {
+            case W::WIRETYPE_VARINT:
+                if ((r = _peekvarint(p, n, &pos, &value)) <= 0) return r;
+                *size = pos;
+                return 1;
+            case W::WIRETYPE_FIXED64:
+                *size = pos + 8;
+                return 1;
+            case W::WIRETYPE_FIXED32:
+                *size = pos + 4;
+                return 1;
+            case W::WIRETYPE_LENGTH_DELIMITED:
+                if ((r = _peekvarint(p, n, &pos, &value)) <= 0) return r;
+                if (value > INT_MAX) return -1;
+                *size = pos + value;
+                return 1;
+            case W::WIRETYPE_START_GROUP:
+            {
+                google::protobuf::io::CodedInputStream input(p, (int)std::min(n, (size_t)INT_MAX));
+                if (!W::SkipField(&input, input.ReadTag())) return 0;
+                *size = input.CurrentPosition();
+                return 1;
+            }
+            default:
+                return -1;
+        }
+    }
+
+    // strict mode: the decoder fails for reason
+    static void _decoderfail(StreamDecoder* pDecoder, const char* reason)
+    {
+        pDecoder->failed = true;
+        pDecoder->failure = reason;
+    }
+
+    // one complete top level field => merged into the table at top
+    // each map entry comes as a field of its own, so strict mode counts them here
+    static void _decodefield(lua_State *L, StreamDecoder* pDecoder, const google::protobuf::uint8* p, size_t size)
+    {
+        int top = lua_gettop(L);
+        CodecState* pState = _getstate(L);
+        google::protobuf::io::CodedInputStream input(p, (int)size);
+
+        if (pState->strict)
+        {
+            google::protobuf::uint64 tag;
+            size_t pos = 0;
+
+            _strictinput(pState, &input, 0);
+            _peekvarint(p, size, &pos, &tag);
+            auto plan = _findfield(pDecoder->plan, google::protobuf::internal::WireFormatLite::GetTagFieldNumber((google::protobuf::uint32)tag));
+            if (pState->maxrepeated > 0 && plan && plan->field->is_map())
+            {
+                pDecoder->entries.resize(pDecoder->plan->fields.size());
+                if (++pDecoder->entries[plan->field->index()] > pState->maxrepeated)
+                {
+                    _decoderfail(pDecoder, "too many repeated elements");
+                    return;
+                }
+            }
+        }
+        if (!_decodemsg(L, &input, pDecoder->plan, 0) || !input.ConsumedEntireMessage())
+        {
+            pDecoder->failed = true;
+            if (pState->strict) pDecoder->failure = pState->failure ? pState->failure : "malformed message";
+        }
+        lua_settop(L, top);
+    }
+
+    // decodes every complete top level field fed so far and keeps only the incomplete rest
+    // fields inside one chunk are decoded in place, a split field is copied once and resumed from its known size
+    // returns false once the data is malformed, later chunks are then ignored
+    // with option("strict") the limits apply to the whole message fed so far and a failure returns false, reason
+    static int _decoderfeed(lua_State *L)
+    {
+        CodecState* pState = _getstate(L);
+        StreamDecoder* pDecoder;
+        const google::protobuf::uint8* p, *base;
+        size_t sz, pos, have, size, take;
+        int r;
+
+        pDecoder = _checkdecoder(L);
+        TypeStats* pStats = _typestats(L, pDecoder->plan->descriptor);
+        google::protobuf::uint64 start = pStats ? _now() : 0;
+        if (lua_isuserdata(L, 2))
+        {
+            p = (const google::protobuf::uint8*)lua_touserdata(L, 2);
+            sz = luaL_checkinteger(L, 3);
+        }
+        else
+        {
+            p = (const google::protobuf::uint8*)luaL_checklstring(L, 2, &sz);
+        }
+
+        lua_settop(L, 3);
+        lua_getuservalue(L, 1);
+        std::string& pending = pDecoder->pending;
+        pDecoder->fed += sz;
+        if (pState->strict && pState->maxsize > 0 && pDecoder->fed > pState->maxsize && !pDecoder->failed) _decoderfail(pDecoder, "message too large");
+        pos = 0;
+        while (!pDecoder->failed && pos < sz)
+        {
+            if (pDecoder->need > 0)                     //rest of a field whose size is known
+            {
+                take = std::min(pDecoder->need - pending.size(), sz - pos);
+                pending.append((const char*)p + pos, take);
+                pos += take;
+                if (pending.size() < pDecoder->need) break;
+
+                _decodefield(L, pDecoder, (const google::protobuf::uint8*)pending.data(), pending.size());
+                pending.clear();
+                pDecoder->need = 0;
+                continue;
+            }
+
+            if (pending.empty())
+            {
+                base = p + pos;
+                have = sz - pos;
+            }
+            else                                        //header or group still incomplete, it can only end in this chunk
+            {
+                pending.append((const char*)p + pos, sz - pos);
+                base = (const google::protobuf::uint8*)pending.data();
+                have = pending.size();
+            }
+
+            r = _fieldsize(base, have, &size);
+            if (r < 0)
+            {
+                pDecoder->failed = true;
+                if (pState->strict) pDecoder->failure = "malformed message";
+                break;
+            }
+            if (r == 0 || size > have)
+            {
+                if (pending.empty()) pending.assign((const char*)base, have);
+                if (r == 1) pDecoder->need = size;
+                break;
+            }
+
+            _decodefield(L, pDecoder, base, size);
+            if (pending.empty()) pos += size;
+            else
+            {
+                pos = sz - (have - size);               //bytes after the field came from this chunk
+                pending.clear();
+            }
+        }
+        if (pStats) pDecoder->tablens += _now() - start;
+
+        lua_pushboolean(L, !pDecoder->failed);
+        if (pDecoder->failed && pDecoder->failure)
+        {
+            lua_pushstring(L, pDecoder->failure);
+            return 2;
+        }
+        return 1;
+    }
+
+    // finish() => the decoded table, or nothing when the data was malformed or ended inside a field
+    // with option("strict") that is nil, reason instead, missing required fields included
+    // the decoder is reset for the next message either way
+    static int _decoderfinish(lua_State *L)
+    {
+        const google::protobuf::FieldDescriptor* missing = nullptr;
+        StreamDecoder* pDecoder;
+        const char* failure;
+        bool ok;
+
+        pDecoder = _checkdecoder(L);
+        ok = !pDecoder->failed && pDecoder->pending.empty();
+        failure = pDecoder->failure;
+        size_t fed = pDecoder->fed;
+        google::protobuf::uint64 tablens = pDecoder->tablens;
+
+        lua_settop(L, 1);
+        lua_getuservalue(L, 1);
+        lua_newtable(L);
+        lua_setuservalue(L, 1);
+        std::string().swap(pDecoder->pending);
+        std::vector<size_t>().swap(pDecoder->entries);
+        pDecoder->need = 0;
+        pDecoder->fed = 0;
+        pDecoder->tablens = 0;
+        pDecoder->failed = false;
+        pDecoder->failure = nullptr;
+
+        TypeStats* pStats = _typestats(L, pDecoder->plan->descriptor);
+        if (!_getstate(L)->strict)
+        {
+            if (ok && pStats) _countdecode(pStats, fed, tablens, 0);
+            return ok ? 1 : 0;
+        }
+        if (ok && pDecoder->plan->required) missing = _checkrequired(L, 2, pDecoder->plan, 0);
+        if (missing) return _requiredfail(L, missing);
+        if (ok && pStats) _countdecode(pStats, fed, tablens, 0);
+        if (ok) return 1;
+        lua_pushnil(L);
+        lua_pushstring(L, failure ? failure : "malformed message");
+        return 2;
+    }
+
+    // proxy for pMsg => top, root is the index of the proxy owning the message, 0 when the new proxy owns it
+    static LazyMessage* _newlazy(lua_State *L, const google::protobuf::Message* pMsg, int root)
+    {
+        LazyMessage* pLazy = (LazyMessage*)lua_newuserdata(L, sizeof(LazyMessage));
+
+        pLazy->msg = pMsg;
+        pLazy->plan = nullptr;
+        pLazy->owned = nullptr;
+        lua_pushvalue(L, lua_upvalueindex(7));
+        lua_setmetatable(L, -2);
+        lua_newtable(L);
+        if (root != 0)
+        {
+            lua_pushvalue(L, root);
+            lua_rawseti(L, -2, 0);
+        }
+        lua_setuservalue(L, -2);
+        pLazy->plan = _getplan(L, pMsg->GetDescriptor());
+        return pLazy;
+    }
+
+    static bool _lazyhas(const LazyMessage* pLazy, const google::protobuf::FieldDescriptor* field)
+    {
+        auto pReflection = pLazy->msg->GetReflection();
+
+        if (field->is_repeated()) return pReflection->FieldSize(*pLazy->msg, field) > 0;
+        return pReflection->HasField(*pLazy->msg, field);
+    }
+
+    // value of the present field index of the proxy at idx => top, cache is the index of its user value
+    // singular sub messages become proxies themselves, everything else is converted as _msg2table does
+    static void _lazyget(lua_State *L, int idx, int cache, LazyMessage* pLazy, int index)
+    {
+        const FieldPlan* plan = &pLazy->plan->fields[index];
+        auto pReflection = pLazy->msg->GetReflection();
+
+        _pushkeys(L, pLazy->plan);
+        lua_rawgeti(L, -1, index+1);
+        lua_remove(L, -2);                              //key
+        lua_pushvalue(L, -1);
+        if (lua_rawget(L, cache) != LUA_TNIL)
+        {
+            lua_remove(L, -2);
+            return;
+        }
+        lua_pop(L, 1);
+
+        if (plan->sub && !plan->field->is_repeated())
+        {
+            if (pLazy->owned) lua_pushvalue(L, idx);
+            else lua_rawgeti(L, cache, 0);
+            _newlazy(L, &pReflection->GetMessage(*pLazy->msg, plan->field), lua_gettop(L));
+            lua_remove(L, -2);
+        }
+        else
+        {
+            _dropoffer(L);
+            plan->push(L, pLazy->msg, pReflection, plan);
+        }
+
+        lua_pushvalue(L, -1);
+        lua_insert(L, -3);                              //value, key, value
+        lua_rawset(L, cache);
+    }
+
+    static int _lazyindex(lua_State *L)
+    {
+        LazyMessage* pLazy;
+        lua_Integer index;
+
+        pLazy = (LazyMessage*)_checkobject(L, 1, 7, "message expected");
+        lua_settop(L, 2);
+        lua_getuservalue(L, 1);
+        _pushkeys(L, pLazy->plan);
+        lua_pushvalue(L, 2);
+        index = lua_rawget(L, -2) == LUA_TNUMBER ? lua_tointeger(L, -1) : 0;
+        lua_settop(L, 2);
+        lua_getuservalue(L, 1);
+
+        if (index == 0 || !_lazyhas(pLazy, pLazy->plan->fields[index-1].field)) return 0;
+        _lazyget(L, 1, 3, pLazy, index-1);
+        return 1;
+    }
+
+    // next(proxy, key) => next present field in declaration order
+    static int _lazynext(lua_State *L)
+    {
+        LazyMessage* pLazy;
+        lua_Integer index;
+
+        pLazy = (LazyMessage*)_checkobject(L, 1, 7, "message expected");
+        lua_settop(L, 2);
+        lua_getuservalue(L, 1);
+        index = 0;
+        if (!lua_isnil(L, 2))
+        {
+            _pushkeys(L, pLazy->plan);
+            lua_pushvalue(L, 2);
+            index = lua_rawget(L, -2) == LUA_TNUMBER ? lua_tointeger(L, -1) : 0;
+            if (index == 0) luaL_error(L, "invalid key to 'next'");
+            lua_settop(L, 2);
+            lua_getuservalue(L, 1);
+        }
+
+        for (; index < (lua_Integer)pLazy->plan->fields.size(); index++)
+        {
+            if (!_lazyhas(pLazy, pLazy->plan->fields[index].field)) continue;
+            _pushkeys(L, pLazy->plan);
+            lua_rawgeti(L, -1, index+1);
+            _lazyget(L, 1, 3, pLazy, index);
+            return 2;
+        }
+        return 0;
+    }
+
+    static int _lazypairs(lua_State *L)
+    {
+        _checkobject(L, 1, 7, "message expected");
+        lua_getfield(L, lua_upvalueindex(7), "__next");
+        lua_pushvalue(L, 1);
+        lua_pushnil(L);
+        return 3;
+    }
 
-        pDesc = pMsg->GetDescriptor();
-		if (pDesc == nullptr) luaL_error(L, "GetDescriptor Failed!");
+    static int _lazygc(lua_State *L)
+    {
+        LazyMessage* pLazy = (LazyMessage*)lua_touserdata(L, 1);
+        delete pLazy->owned;
+        pLazy->owned = nullptr;
+        return 0;
+    }
 
-        pKeyField = pDesc->FindFieldByName("key");
-        if (pKeyField == nullptr) luaL_error(L, "no key field!");
-        
-        pValueField = pDesc->FindFieldByName("value");
-        if (pValueField == nullptr) luaL_error(L, "no value field!");
+    // binary data / lightuserdata => proxy converting fields on first access
+    // sub messages are proxies too, repeated and map fields are converted whole on first access
+    // with option("strict") the data is checked as deserialize does before the proxy is made
+    static int deserialize_lazy(lua_State *L)
+    {
+        const google::protobuf::Message* pMessage;
+        LazyMessage* pLazy;
+        const void* data;
+        size_t sz;
 
-        lua_pushvalue(L, -2);                           //key, value, key
+        luaL_checkstring(L, 1);
+        if (lua_isuserdata(L, 2))
+        {
+            data = (const void*)lua_touserdata(L, 2);
+            sz = luaL_checkinteger(L, 3);
+        }
+        else
+        {
+            data = luaL_checklstring(L, 2, &sz);
+        }
 
-        _setfield(L, pMsg, pReflection, pKeyField);
+        pMessage = _getprototype(L, 1);
+        if (!pMessage) return 0;
 
-        lua_pop(L, 1);
+        CodecState* pState = _getstate(L);
+        TypeStats* pStats = _typestats(L, pMessage->GetDescriptor());
+        google::protobuf::uint64 start = pStats ? _now() : 0;
+        std::unique_ptr<google::protobuf::Message> msg(pMessage->New());    //outlives the call, so never from the arena or the pool
+        if (!pState->strict) msg->ParseFromArray(data, sz);
+        else if (!_strictparse(L, pState, msg.get(), data, sz)) return 2;
+        if (pStats) _countdecode(pStats, sz, 0, _now() - start);
 
-        _setfield(L, pMsg, pReflection, pValueField);
+        pLazy = _newlazy(L, msg.get(), 0);
+        pLazy->owned = msg.release();
+        return 1;
     }
 
-    static void _setmap(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const google::protobuf::FieldDescriptor *field)
+    // shared by every lua_State of the process, started on first use and kept until exit
+    struct DecodeWorkers
     {
-        size_t len;
-        if (!lua_istable(L, -1)) return;
-
-        if (field->cpp_type() != google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE)
-            luaL_error(L, "map cpptype must be message!");
+        std::mutex lock;
+        std::condition_variable wake;
+        std::deque<AsyncDecode*> jobs;
+    };
 
-        lua_pushnil(L);
-        while (lua_next(L, -2) != 0)
+    static void _decodeworker(DecodeWorkers* pWorkers)
+    {
+        for (;;)
         {
-            auto pSubMsg = pReflection->AddMessage(pMsg, field);
-            _kv2msg(L, pSubMsg);
-            lua_pop(L, 1);
+            AsyncDecode* pJob;
+            {
+                std::unique_lock<std::mutex> guard(pWorkers->lock);
+                pWorkers->wake.wait(guard, [pWorkers] { return !pWorkers->jobs.empty(); });
+                pJob = pWorkers->jobs.front();
+                pWorkers->jobs.pop_front();
+            }
+
+            google::protobuf::uint64 start = _now();
+            if (!pJob->strict) pJob->msg->ParseFromArray(pJob->data, pJob->size);
+            else pJob->failure = _strictcheck(pJob->msg.get(), pJob->plan, pJob->data, pJob->size, pJob->maxdepth, pJob->maxsize, pJob->maxrepeated, &pJob->missing);
+            pJob->wirens = _now() - start;
+
+            std::lock_guard<std::mutex> guard(pJob->lock);
+            pJob->done = true;
+            pJob->finished.notify_all();
         }
     }
 
-    static void _setfield(lua_State *L, google::protobuf::Message* pMsg, const google::protobuf::Message::Reflection* pReflection, const google::protobuf::FieldDescriptor *field)
+    static DecodeWorkers* _getworkers()
     {
-        switch (field->label())
+        static DecodeWorkers* pWorkers = []
         {
-            case google::protobuf::FieldDescriptor::LABEL_OPTIONAL:
-            case google::protobuf::FieldDescriptor::LABEL_REQUIRED: _setsingle(L, pMsg, pReflection, field); break;
-            case google::protobuf::FieldDescriptor::LABEL_REPEATED: field->is_map() ? _setmap(L, pMsg, pReflection, field) : _setarray(L, pMsg, pReflection, field); break;
-            default: break;
-        }
+            DecodeWorkers* p = new DecodeWorkers();
+            unsigned count = std::max(1u, std::thread::hardware_concurrency());
+            for (unsigned i=0; i<count; i++) std::thread(_decodeworker, p).detach();
+            return p;
+        }();
+        return pWorkers;
     }
 
-    static void _table2msg(lua_State *L, google::protobuf::Message* pMsg)
+    static AsyncDecode* _checkasync(lua_State *L)
     {
-        const google::protobuf::Message::Reflection* pReflection;
-        const google::protobuf::Descriptor* pDescriptor;
-        const google::protobuf::FieldDescriptor* pFieldDsp;
-  		pReflection = pMsg->GetReflection();
-        pDescriptor = pMsg->GetDescriptor();
-		if (pReflection == nullptr || pDescriptor == nullptr) return;
-       
-        if (!lua_istable(L, -1)) return;
-
-        lua_pushnil(L);
-        while (lua_next(L, -2) != 0)
-        {
-            const char* key = luaL_checkstring(L, -2);
-            auto field = pDescriptor->FindFieldByName(key);
-            if (field == nullptr) luaL_error(L, "invalid field %s!", key);
-            _setfield(L, pMsg, pReflection, field);
-            lua_pop(L, 1);
-        }
+        return (AsyncDecode*)_checkobject(L, 1, 10, "async decode expected");
     }
 
-    // lua table => binary data / callback(msg)
-    static int serialize(lua_State *L)
+    static void _waitasync(AsyncDecode* pJob)
     {
-        google::protobuf::Message* msg;
-        const char* name;
-        std::string data;
+        std::unique_lock<std::mutex> guard(pJob->lock);
+        pJob->finished.wait(guard, [pJob] { return pJob->done; });
+    }
 
-        name = luaL_checkstring(L, 1);
-        msg = _newmsg(L, name);
-        if (!msg) return 0;
+    static int _asyncgc(lua_State *L)
+    {
+        AsyncDecode* pJob = (AsyncDecode*)lua_touserdata(L, 1);
+        _waitasync(pJob);
+        pJob->~AsyncDecode();
+        return 0;
+    }
 
-        if (lua_isfunction(L, -1))
-        {
-            lua_replace(L, 1);
-        }
+    // handle:ready() => true once the worker is done, never blocks
+    static int _asyncready(lua_State *L)
+    {
+        AsyncDecode* pJob = _checkasync(L);
+        std::lock_guard<std::mutex> guard(pJob->lock);
+        lua_pushboolean(L, pJob->done);
+        return 1;
+    }
 
-        std::unique_ptr<google::protobuf::Message> ptr(msg);    //below code may throw exception, so use unique_ptr to release memory
+    // handle:result() => lua table, waits for the worker if needed
+    // the table is built once and kept, the parsed message and the data are released then
+    // data rejected in strict mode gives nil, reason on every call
+    static int _asyncresult(lua_State *L)
+    {
+        AsyncDecode* pJob = _checkasync(L);
 
-        _table2msg(L, msg);
+        lua_getuservalue(L, 1);
+        if (lua_rawgeti(L, -1, 2) != LUA_TNIL) return 1;
+        lua_pop(L, 1);
 
-        if (lua_isfunction(L, 1))
+        _waitasync(pJob);
+        if (pJob->failure)
         {
-            lua_settop(L, 1);
-            lua_pushlightuserdata(L, (void*)msg);
-            lua_call(L, 1, 0);
-            return 0;
-        }
-        else
-        {
-            msg->SerializeToString(&data);
-            lua_pushlstring(L, data.c_str(), data.length());
-            return 1;
+            pJob->msg.reset();
+            pJob->data = nullptr;
+            lua_pushnil(L);
+            lua_rawseti(L, -2, 1);
+            lua_pushnil(L);
+            if (pJob->missing.empty()) lua_pushstring(L, pJob->failure);
+            else lua_pushfstring(L, "%s: %s", pJob->failure, pJob->missing.c_str());
+            return 2;
         }
+        TypeStats* pStats = _typestats(L, pJob->msg->GetDescriptor());
+        google::protobuf::uint64 start = pStats ? _now() : 0;
+        _dropoffer(L);
+        _msg2table(L, pJob->msg.get());
+        if (pStats) _countdecode(pStats, pJob->size, _now() - start, pJob->wirens);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -3, 2);
+        lua_pushnil(L);
+        lua_rawseti(L, -3, 1);
+        pJob->msg.reset();
+        pJob->data = nullptr;
+        return 1;
     }
 
-    // binary data / lightuserdata => lua table
-    static int deserialize(lua_State *L)
+    // deserialize_async(name, data | ptr, sz) => handle with :ready() and :result()
+    // the bytes are parsed on a worker thread while the caller goes on, a lightuserdata must stay valid until result()
+    // with option("strict") the worker checks the data with the limits set when the call was made
+    static int deserialize_async(lua_State *L)
     {
-        google::protobuf::Message* msg;
-        const char* name;
-        const void* data;
-        size_t sz;
+        const google::protobuf::Message* pMessage;
+        CodecState* pState;
+        DecodeWorkers* pWorkers;
+        AsyncDecode* pJob;
+
+        luaL_checkstring(L, 1);
+        if (!lua_isuserdata(L, 2)) luaL_checkstring(L, 2);
+
+        pMessage = _getprototype(L, 1);
+        if (!pMessage) return 0;
+
+        pJob = new (lua_newuserdata(L, sizeof(AsyncDecode))) AsyncDecode();
+        pJob->done = true;                              //nothing to wait for until it is queued
+        lua_pushvalue(L, lua_upvalueindex(10));
+        lua_setmetatable(L, -2);
+        lua_createtable(L, 2, 0);
+        lua_pushvalue(L, 2);
+        lua_rawseti(L, -2, 1);
+        lua_setuservalue(L, -2);
 
-        name = luaL_checkstring(L, 1);
         if (lua_isuserdata(L, 2))
         {
-            data = (const void*)lua_touserdata(L, 2);
-            sz = luaL_checkinteger(L, 3);
+            pJob->data = lua_touserdata(L, 2);
+            pJob->size = luaL_checkinteger(L, 3);
         }
         else
         {
-            data = luaL_checklstring(L, 2, &sz);
+            pJob->data = lua_tolstring(L, 2, &pJob->size);
         }
+        pJob->msg.reset(pMessage->New());               //parsed off this thread, so never from the arena or the pool
+        pState = _getstate(L);
+        pJob->strict = pState->strict;
+        pJob->maxdepth = pState->maxdepth;
+        pJob->maxsize = pState->maxsize;
+        pJob->maxrepeated = pState->maxrepeated;
+        pJob->plan = _getplan(L, pMessage->GetDescriptor());
+        pJob->failure = nullptr;
+        pWorkers = _getworkers();
 
-        msg = _newmsg(L, name);
-        if (!msg) return 0;
-        msg->ParseFromArray(data, sz);
-
-        std::unique_ptr<google::protobuf::Message> ptr(msg);    //below code may throw exception, so use unique_ptr to release memory
-
-        _msg2table(L, msg);
-
+        pJob->done = false;
+        {
+            std::lock_guard<std::mutex> guard(pWorkers->lock);
+            pWorkers->jobs.push_back(pJob);
+        }
+        pWorkers->wake.notify_one();
         return 1;
     }
 
@@ -550,7 +3945,6 @@ namespace LuaModule {
     static int debugstr(lua_State *L)
     {
         google::protobuf::Message* msg;
-        const char* name;
         const void* data;
         size_t sz;
         int opt;
@@ -558,7 +3952,7 @@ namespace LuaModule {
 
         static const char* mode[] = {"debug", "short", "utf8"};
 
-        name = luaL_checkstring(L, 1);
+        luaL_checkstring(L, 1);
         if (lua_isuserdata(L, 2))
         {
             data = (const void*)lua_touserdata(L, 2);
@@ -571,11 +3965,16 @@ namespace LuaModule {
             opt = luaL_checkoption(L, 3, "short", mode);
         }
 
-        msg = _newmsg(L, name);
+        msg = _newmsg(L, 1);
         if (!msg) return 0;
-        msg->ParseFromArray(data, sz);
+        MessagePtr ptr = _holdmsg(L, msg);    //below code may throw exception, so use unique_ptr to release memory
 
-        std::unique_ptr<google::protobuf::Message> ptr(msg);    //below code may throw exception, so use unique_ptr to release memory
+        CodecState* pState = _getstate(L);
+        TypeStats* pStats = _typestats(L, msg->GetDescriptor());
+        google::protobuf::uint64 start = pStats ? _now() : 0;
+        if (!pState->strict) msg->ParseFromArray(data, sz);
+        else if (!_strictparse(L, pState, msg, data, sz)) return 2;
+        if (pStats) _countdecode(pStats, sz, 0, _now() - start);
 
         switch (opt)
         {
@@ -595,20 +3994,486 @@ namespace LuaModule {
         return 1;
     }
 
+    // option(name [, value]) => previous value
+    // "arena": bytes of arena memory kept for the temporary message of serialize/deserialize/debugstr, 0 = heap
+    // "pool": cleared messages kept per type for reuse by the same calls, 0 = off
+    // "bytesview": bytes fields at least this long reach a deserialize callback as {lightuserdata, length}, 0 = off
+    // "typedarray": numeric repeated fields at least this long are returned as typed arrays, 0 = off
+    // "enum": "name" or "number", how enum values are returned, both are accepted when setting
+    // "stats": per type counters returned by stats(), off by default
+    // "strict": decoding calls, stream, batch, lazy and async ones included, report bad data with a reason instead of a partial result
+    // "maxdepth", "maxsize", "maxrepeated": limits checked in strict mode, 0 = none
+    // protobuf's parse cannot count elements, so with "maxrepeated" set the calls going through a message (deserialize without
+    // a field mask, deserialize_into, debugstr, lazy, async) read the wire once more first, about twice their parse cost;
+    // the direct wire decoders count as they go
+    static int option(lua_State *L)
+    {
+        static const char* names[] = {"arena", "pool", "bytesview", "typedarray", "enum", "stats", "strict", "maxdepth", "maxsize", "maxrepeated", NULL};
+        static const char* enums[] = {"name", "number", NULL};
+        CodecState* pState = _getstate(L);
+
+        switch (luaL_checkoption(L, 1, NULL, names))
+        {
+        case 0:
+            lua_pushinteger(L, pState->arenasize);
+            if (!lua_isnoneornil(L, 2))
+            {
+                luaL_argcheck(L, luaL_checkinteger(L, 2) >= 0, 2, "size must not be negative");
+                _setarena(L, pState, lua_tointeger(L, 2));
+            }
+            break;
+        case 1:
+            lua_pushinteger(L, pState->poolsize);
+            if (!lua_isnoneornil(L, 2))
+            {
+                luaL_argcheck(L, luaL_checkinteger(L, 2) >= 0, 2, "size must not be negative");
+                _setpool(pState, lua_tointeger(L, 2));
+            }
+            break;
+        case 2:
+            lua_pushinteger(L, pState->bytesview);
+            if (!lua_isnoneornil(L, 2))
+            {
+                luaL_argcheck(L, luaL_checkinteger(L, 2) >= 0, 2, "size must not be negative");
+                pState->bytesview = lua_tointeger(L, 2);
+            }
+            break;
+        case 3:
+            lua_pushinteger(L, pState->typedarray);
+            if (!lua_isnoneornil(L, 2))
+            {
+                luaL_argcheck(L, luaL_checkinteger(L, 2) >= 0, 2, "size must not be negative");
+                pState->typedarray = lua_tointeger(L, 2);
+            }
+            break;
+        case 4:
+            lua_pushstring(L, enums[pState->enumnumber ? 1 : 0]);
+            if (!lua_isnoneornil(L, 2)) pState->enumnumber = luaL_checkoption(L, 2, NULL, enums) == 1;
+            break;
+        case 5:
+            lua_pushboolean(L, pState->stats);
+            if (!lua_isnone(L, 2)) pState->stats = lua_toboolean(L, 2);
+            break;
+        case 6:
+            lua_pushboolean(L, pState->strict);
+            if (!lua_isnone(L, 2)) pState->strict = lua_toboolean(L, 2);
+            break;
+        case 7:
+            lua_pushinteger(L, pState->maxdepth);
+            if (!lua_isnoneornil(L, 2))
+            {
+                luaL_argcheck(L, luaL_checkinteger(L, 2) >= 0 && lua_tointeger(L, 2) <= INT_MAX, 2, "depth out of range");
+                pState->maxdepth = (int)lua_tointeger(L, 2);
+            }
+            break;
+        case 8:
+            lua_pushinteger(L, pState->maxsize);
+            if (!lua_isnoneornil(L, 2))
+            {
+                luaL_argcheck(L, luaL_checkinteger(L, 2) >= 0, 2, "size must not be negative");
+                pState->maxsize = lua_tointeger(L, 2);
+            }
+            break;
+        case 9:
+            lua_pushinteger(L, pState->maxrepeated);
+            if (!lua_isnoneornil(L, 2))
+            {
+                luaL_argcheck(L, luaL_checkinteger(L, 2) >= 0, 2, "size must not be negative");
+                pState->maxrepeated = lua_tointeger(L, 2);
+            }
+            break;
+        default:
+            break;
+        }
+        return 1;
+    }
 
-    int luaopen_proto_core(lua_State *L)
+    static google::protobuf::util::TypeResolver* _getresolver(lua_State *L, CodecState* pState)
+    {
+        if (!pState->resolver)
+        {
+            auto pDPool = (const google::protobuf::DescriptorPool*)lua_touserdata(L, lua_upvalueindex(1));
+            pState->resolver.reset(google::protobuf::util::NewTypeResolverForDescriptorPool(JSON_TYPE_URL, pDPool));
+        }
+        return pState->resolver.get();
+    }
+
+    // status of a transcode => pState->json at top, or nil, reason
+    static int _pushjson(lua_State *L, CodecState* pState, const google::protobuf::util::Status& status)
+    {
+        if (!status.ok())
+        {
+            std::string reason = status.ToString();
+            lua_pushnil(L);
+            lua_pushlstring(L, reason.data(), reason.length());
+            return 2;
+        }
+        lua_pushlstring(L, pState->json.data(), pState->json.length());
+        if (pState->json.capacity() > ENCODE_BUFFER_RETAIN) std::string().swap(pState->json);
+        return 1;
+    }
+
+    // tojson(name, data | ptr, sz, opts) => json text, straight from the wire format without a message or table
+    // with option("strict") cut or oversized data returns nil, reason, otherwise the converter prints what it could read
+    // opts take the JsonPrintOptions names: add_whitespace, always_print_primitive_fields, always_print_enums_as_ints, preserve_proto_field_names
+    static int tojson(lua_State *L)
+    {
+        const google::protobuf::Message* pMessage;
+        google::protobuf::util::JsonPrintOptions options;
+        CodecState* pState;
+        const void* data;
+        size_t sz;
+        int opt;
+
+        luaL_checkstring(L, 1);
+        if (lua_isuserdata(L, 2))
+        {
+            data = (const void*)lua_touserdata(L, 2);
+            sz = luaL_checkinteger(L, 3);
+            opt = 4;
+        }
+        else
+        {
+            data = luaL_checklstring(L, 2, &sz);
+            opt = 3;
+        }
+        if (lua_istable(L, opt))
+        {
+            lua_getfield(L, opt, "add_whitespace");
+            options.add_whitespace = lua_toboolean(L, -1);
+            lua_getfield(L, opt, "always_print_primitive_fields");
+            options.always_print_primitive_fields = lua_toboolean(L, -1);
+            lua_getfield(L, opt, "always_print_enums_as_ints");
+            options.always_print_enums_as_ints = lua_toboolean(L, -1);
+            lua_getfield(L, opt, "preserve_proto_field_names");
+            options.preserve_proto_field_names = lua_toboolean(L, -1);
+            lua_pop(L, 4);
+        }
+
+        pMessage = _getprototype(L, 1);
+        if (!pMessage) return 0;
+
+        pState = _getstate(L);
+        if (pState->strict)                             //the converter prints what it got from cut data, so the wire structure is checked first
+        {
+            google::protobuf::io::CodedInputStream check((const google::protobuf::uint8*)data, sz);
+            const char* reason = _strictinput(pState, &check, sz);
+            if (reason == nullptr && (!google::protobuf::internal::WireFormatLite::SkipMessage(&check) || !check.ConsumedEntireMessage())) reason = "malformed message";
+            if (reason) return _strictfail(L, pState, reason);
+        }
+
+        pState->json.clear();
+        google::protobuf::io::ArrayInputStream input(data, (int)sz);
+        google::protobuf::util::Status status;
+        {
+            google::protobuf::io::StringOutputStream output(&pState->json);
+            status = google::protobuf::util::BinaryToJsonStream(_getresolver(L, pState), std::string(JSON_TYPE_URL) + "/" + pMessage->GetDescriptor()->full_name(), &input, &output, options);
+        }
+        return _pushjson(L, pState, status);
+    }
+
+    // fromjson(name, json, opts) => binary data, opts.ignore_unknown_fields skips fields the type does not have
+    static int fromjson(lua_State *L)
+    {
+        const google::protobuf::Message* pMessage;
+        google::protobuf::util::JsonParseOptions options;
+        CodecState* pState;
+        const char* json;
+        size_t sz;
+
+        luaL_checkstring(L, 1);
+        json = luaL_checklstring(L, 2, &sz);
+        if (lua_istable(L, 3))
+        {
+            lua_getfield(L, 3, "ignore_unknown_fields");
+            options.ignore_unknown_fields = lua_toboolean(L, -1);
+            lua_pop(L, 1);
+        }
+
+        pMessage = _getprototype(L, 1);
+        if (!pMessage) return 0;
+
+        pState = _getstate(L);
+        pState->json.clear();
+        google::protobuf::io::ArrayInputStream input(json, (int)sz);
+        google::protobuf::util::Status status;
+        {
+            google::protobuf::io::StringOutputStream output(&pState->json);
+            status = google::protobuf::util::JsonToBinaryStream(_getresolver(L, pState), std::string(JSON_TYPE_URL) + "/" + pMessage->GetDescriptor()->full_name(), &input, &output, options);
+        }
+        return _pushjson(L, pState, status);
+    }
+
+    // poolstats() => hits, misses
+    static int poolstats(lua_State *L)
+    {
+        CodecState* pState = _getstate(L);
+
+        lua_pushinteger(L, pState->poolhit);
+        lua_pushinteger(L, pState->poolmiss);
+        return 2;
+    }
+
+    // stats(reset) => {[type name] = {encodes, decodes, bytesout, bytesin, wirens, tablens, allocs}}, see option("stats")
+    // counters are zeroed after reading when reset is true
+    static int stats(lua_State *L)
+    {
+        CodecState* pState = _getstate(L);
+        bool reset = lua_toboolean(L, 1);
+
+        lua_createtable(L, 0, pState->typestats.size());
+        for (auto& it : pState->typestats)
+        {
+            const TypeStats& s = it.second;
+            auto& name = it.first->full_name();
+
+            lua_createtable(L, 0, 7);
+            lua_pushinteger(L, (lua_Integer)s.encodes);
+            lua_setfield(L, -2, "encodes");
+            lua_pushinteger(L, (lua_Integer)s.decodes);
+            lua_setfield(L, -2, "decodes");
+            lua_pushinteger(L, (lua_Integer)s.bytesout);
+            lua_setfield(L, -2, "bytesout");
+            lua_pushinteger(L, (lua_Integer)s.bytesin);
+            lua_setfield(L, -2, "bytesin");
+            lua_pushinteger(L, (lua_Integer)s.wirens);
+            lua_setfield(L, -2, "wirens");
+            lua_pushinteger(L, (lua_Integer)s.tablens);
+            lua_setfield(L, -2, "tablens");
+            lua_pushinteger(L, (lua_Integer)s.allocs);
+            lua_setfield(L, -2, "allocs");
+            lua_setfield(L, -2, name.c_str());
+            if (reset) it.second = TypeStats();         //zeroed in place, a running call may still hold the entry
+        }
+        return 1;
+    }
+
+    static int _arrayindex(lua_State *L)
+    {
+        TypedArray* pArray = (TypedArray*)_checkobject(L, 1, 9, "array expected");
+        int isnum;
+        lua_Integer i = lua_tointegerx(L, 2, &isnum);
+
+        if (!isnum || i < 1 || (size_t)i > pArray->count) return 0;
+        _pusharrayat(L, pArray, i-1);
+        return 1;
+    }
+
+    // lua number at idx => element i (0 based)
+    static void _arrayset(lua_State *L, TypedArray* pArray, size_t i, int idx)
+    {
+        void* data = _arraydata(pArray);
+
+        switch (pArray->type)
+        {
+            case google::protobuf::FieldDescriptor::CPPTYPE_INT32: ((google::protobuf::int32*)data)[i] = (google::protobuf::int32)luaL_checkinteger(L, idx); break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_UINT32: ((google::protobuf::uint32*)data)[i] = (google::protobuf::uint32)luaL_checkinteger(L, idx); break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_INT64: ((google::protobuf::int64*)data)[i] = (google::protobuf::int64)luaL_checkinteger(L, idx); break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_UINT64: ((google::protobuf::uint64*)data)[i] = (google::protobuf::uint64)luaL_checkinteger(L, idx); break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT: ((float*)data)[i] = (float)luaL_checknumber(L, idx); break;
+            case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE: ((double*)data)[i] = luaL_checknumber(L, idx); break;
+            default: break;
+        }
+    }
+
+    static int _arraynewindex(lua_State *L)
+    {
+        TypedArray* pArray = (TypedArray*)_checkobject(L, 1, 9, "array expected");
+        lua_Integer i = luaL_checkinteger(L, 2);
+
+        luaL_argcheck(L, i >= 1 && (size_t)i <= pArray->count, 2, "index out of range");
+        _arrayset(L, pArray, i-1, 3);
+        return 0;
+    }
+
+    static int _arraylen(lua_State *L)
+    {
+        TypedArray* pArray = (TypedArray*)_checkobject(L, 1, 9, "array expected");
+        lua_pushinteger(L, pArray->count);
+        return 1;
+    }
+
+    static const char* ARRAY_NAMES[] = {"int32", "int64", "uint32", "uint64", "double", "float", NULL};
+    static const google::protobuf::FieldDescriptor::CppType ARRAY_TYPES[] = {
+        google::protobuf::FieldDescriptor::CPPTYPE_INT32, google::protobuf::FieldDescriptor::CPPTYPE_INT64,
+        google::protobuf::FieldDescriptor::CPPTYPE_UINT32, google::protobuf::FieldDescriptor::CPPTYPE_UINT64,
+        google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE, google::protobuf::FieldDescriptor::CPPTYPE_FLOAT,
+    };
+
+    // array(type, n | tbl) => typed array of n zeros or of the numbers in tbl, accepted wherever a numeric repeated field is set
+    static int array(lua_State *L)
+    {
+        auto type = ARRAY_TYPES[luaL_checkoption(L, 1, NULL, ARRAY_NAMES)];
+        TypedArray* pArray;
+        size_t count;
+
+        if (lua_istable(L, 2))
+        {
+            count = lua_rawlen(L, 2);
+            pArray = _newarray(L, type, count);
+            for (size_t i=1; i<=count; i++)
+            {
+                lua_rawgeti(L, 2, i);
+                _arrayset(L, pArray, i-1, -1);
+                lua_pop(L, 1);
+            }
+            return 1;
+        }
+
+        luaL_argcheck(L, luaL_checkinteger(L, 2) >= 0, 2, "size must not be negative");
+        _newarray(L, type, lua_tointeger(L, 2));
+        return 1;
+    }
+
+    // arrayptr(arr) => lightuserdata to the elements, count, element type
+    static int arrayptr(lua_State *L)
+    {
+        TypedArray* pArray = (TypedArray*)_checkobject(L, 1, 9, "array expected");
+        int i = 0;
+
+        while (ARRAY_TYPES[i] != pArray->type) i++;
+        lua_pushlightuserdata(L, _arraydata(pArray));
+        lua_pushinteger(L, pArray->count);
+        lua_pushstring(L, ARRAY_NAMES[i]);
+        return 3;
+    }
+
+    // functions in l => table at top, sharing the library upvalues at base+1 .. base+UPVALUES
+    static void _setshared(lua_State *L, const luaL_Reg* l, int base)
+    {
+        for (int i=1; i<=UPVALUES; i++) lua_pushvalue(L, base+i);
+        luaL_setfuncs(L, l, UPVALUES);
+    }
+
+    // module table bound to a descriptor pool and message factory => top, a loaded schema is owned by its CodecState
+    static void _newlib(lua_State *L, const google::protobuf::DescriptorPool* pDPool, google::protobuf::MessageFactory* pMFactory, LoadedSchema* pSchema)
     {
-        luaL_checkversion(L);
         luaL_Reg l[] = {
             {"serialize",           serialize},
+            {"serialize_into",      serialize_into},
+            {"serialize_batch",     serialize_batch},
             {"deserialize",         deserialize},
+            {"deserialize_batch",   deserialize_batch},
+            {"deserialize_into",    deserialize_into},
             {"debugstr",            debugstr},
+            {"decode",              decode},
+            {"encode",              encode},
+            {"option",              option},
+            {"poolstats",           poolstats},
+            {"stats",               stats},
+            {"tojson",              tojson},
+            {"fromjson",            fromjson},
+            {"decoder",             decoder},
+            {"deserialize_lazy",    deserialize_lazy},
+            {"array",               array},
+            {"arrayptr",            arrayptr},
+            {"load",                load},
+            {"deserialize_async",   deserialize_async},
+            {"serialize_delta",     serialize_delta},
+            {"apply_delta",         apply_delta},
+            {NULL,                  NULL}
+        };
+        luaL_Reg m[] = {
+            {"feed",                _decoderfeed},
+            {"finish",              _decoderfinish},
+            {NULL,                  NULL}
+        };
+        luaL_Reg lazy[] = {
+            {"__index",             _lazyindex},
+            {"__pairs",             _lazypairs},
+            {"__next",              _lazynext},
+            {NULL,                  NULL}
+        };
+        luaL_Reg arr[] = {
+            {"__index",             _arrayindex},
+            {"__newindex",          _arraynewindex},
+            {"__len",               _arraylen},
+            {NULL,                  NULL}
+        };
+        luaL_Reg async[] = {
+            {"ready",               _asyncready},
+            {"result",              _asyncresult},
             {NULL,                  NULL}
         };
+        CodecState* pState;
+        int base;
         luaL_newlibtable(L, l);
-        lua_pushlightuserdata(L, (void*)google::protobuf::DescriptorPool::generated_pool());
-        lua_pushlightuserdata(L, (void*)google::protobuf::MessageFactory::generated_factory());
-        luaL_setfuncs(L, l, 2);
+        lua_pushlightuserdata(L, (void*)pDPool);
+        lua_pushlightuserdata(L, (void*)pMFactory);
+        lua_newtable(L);                                //name => prototype cache
+        pState = new (lua_newuserdata(L, sizeof(CodecState))) CodecState();
+        pState->schema.reset(pSchema);
+        pState->registry = pSchema ? &pSchema->plans : _generatedplans();
+        lua_createtable(L, 0, 1);
+        lua_pushcfunction(L, _stategc);
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
+        lua_newtable(L);                                //descriptor => interned field names
+        lua_createtable(L, 0, 2);                       //stream decoder metatable
+        lua_createtable(L, 0, 4);                       //lazy message metatable
+        lua_newtable(L);                                //path set => compiled field mask
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "v");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_createtable(L, 0, 3);                       //typed array metatable
+        lua_createtable(L, 0, 2);                       //async decode metatable
+        base = lua_gettop(L) - UPVALUES;
+
+        lua_pushcfunction(L, _decodergc);
+        lua_setfield(L, base+6, "__gc");
+        luaL_newlibtable(L, m);
+        _setshared(L, m, base);
+        lua_setfield(L, base+6, "__index");
+
+        lua_pushcfunction(L, _lazygc);
+        lua_setfield(L, base+7, "__gc");
+        lua_pushvalue(L, base+7);
+        _setshared(L, lazy, base);
+        lua_pop(L, 1);
+
+        lua_pushvalue(L, base+9);
+        _setshared(L, arr, base);
+        lua_pop(L, 1);
+
+        lua_pushcfunction(L, _asyncgc);
+        lua_setfield(L, base+10, "__gc");
+        luaL_newlibtable(L, async);
+        _setshared(L, async, base);
+        lua_setfield(L, base+10, "__index");
+
+        luaL_setfuncs(L, l, UPVALUES);
+    }
+
+    // load(fdset) => module for the messages of a serialized FileDescriptorSet, built with --include_imports
+    // types live in a private pool with dynamic messages, plans and options are separate from this module
+    static int load(lua_State *L)
+    {
+        size_t sz;
+        const char* data = luaL_checklstring(L, 1, &sz);
+        LoadedSchema* pSchema = new LoadedSchema();
+        bool ok;
+
+        {
+            google::protobuf::FileDescriptorSet files;
+            ok = files.ParseFromArray(data, sz);
+            for (int i=0; ok && i<files.file_size(); i++) ok = pSchema->database.Add(files.file(i));
+            for (int i=0; ok && i<files.file_size(); i++) ok = pSchema->pool.FindFileByName(files.file(i).name()) != nullptr;
+        }
+        if (!ok)
+        {
+            delete pSchema;
+            return luaL_error(L, "Invalid FileDescriptorSet!");
+        }
+
+        _newlib(L, &pSchema->pool, &pSchema->factory, pSchema);
+        return 1;
+    }
+
+    int luaopen_proto_core(lua_State *L)
+    {
+        luaL_checkversion(L);
+        _newlib(L, google::protobuf::DescriptorPool::generated_pool(), google::protobuf::MessageFactory::generated_factory(), nullptr);
         return 1;
     }
 
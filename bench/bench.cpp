@@ -0,0 +1,303 @@
+#include "lua/lua.hpp"
+#include "bench.pb.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+// serialize / deserialize / debugstr throughput over representative schemas
+// usage: luaproto_bench [--time seconds] [--filter text] [--save file] [--baseline file] [--threshold percent]
+
+namespace LuaModule {
+    int luaopen_proto_core(lua_State *L);
+}
+
+// C++ heap allocations, protobuf messages and strings included
+static size_t g_allocs = 0;
+
+void* operator new(size_t size)
+{
+    g_allocs++;
+    void* p = malloc(size ? size : 1);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+    free(p);
+}
+
+// bytes requested from the Lua allocator, everything the collector has to reclaim later
+static size_t g_luabytes = 0;
+
+static void* _luaalloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    (void)ud;
+    if (nsize == 0)
+    {
+        free(ptr);
+        return nullptr;
+    }
+    if (ptr == nullptr) g_luabytes += nsize;
+    else if (nsize > osize) g_luabytes += nsize - osize;
+    return realloc(ptr, nsize);
+}
+
+struct Result
+{
+    double msgs;                                        // messages per second
+    double bytes;                                       // wire bytes per second
+    double allocs;                                      // C++ allocations per message
+    double luabytes;                                    // Lua allocated bytes per message
+};
+
+struct Case
+{
+    const char* name;
+    const char* type;
+    std::string data;
+    int table;                                          // registry ref of the decoded table
+};
+
+static unsigned _random()
+{
+    static unsigned seed = 12345;
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static std::string _randomstring(size_t len)
+{
+    std::string s(len, ' ');
+    for (auto& c : s) c = 'a' + _random() % 26;
+    return s;
+}
+
+static void _fillflat(bench::Flat* pFlat)
+{
+    pFlat->set_i32(_random() % 100000);
+    pFlat->set_i64((long long)_random() << 20);
+    pFlat->set_u32(_random());
+    pFlat->set_u64((unsigned long long)_random() << 24);
+    pFlat->set_s32(-(int)(_random() % 5000));
+    pFlat->set_s64(-(long long)_random());
+    pFlat->set_f32(_random());
+    pFlat->set_f64((unsigned long long)_random() << 30);
+    pFlat->set_d(_random() / 7.0);
+    pFlat->set_f(_random() % 1000 / 3.0f);
+    pFlat->set_b(true);
+    pFlat->set_name(_randomstring(12));
+    pFlat->set_kind(bench::Flat::MONSTER);
+}
+
+static std::vector<Case> _makecases()
+{
+    std::vector<Case> cases;
+
+    bench::Flat flat;
+    _fillflat(&flat);
+    cases.push_back({"flat", "bench.Flat", flat.SerializeAsString(), LUA_NOREF});
+
+    bench::Deep deep;
+    bench::Deep* pDeep = &deep;
+    for (int i=0; i<32; i++)
+    {
+        pDeep->set_depth(i);
+        pDeep->set_tag(_randomstring(6));
+        pDeep = pDeep->mutable_child();
+    }
+    cases.push_back({"deep", "bench.Deep", deep.SerializeAsString(), LUA_NOREF});
+
+    bench::BigMap map;
+    for (int i=0; i<1000; i++) (*map.mutable_counters())[_randomstring(10)] = _random();
+    for (int i=0; i<100; i++) _fillflat(&(*map.mutable_entries())[i]);
+    cases.push_back({"bigmap", "bench.BigMap", map.SerializeAsString(), LUA_NOREF});
+
+    bench::Numerics numerics;
+    for (int i=0; i<4096; i++)
+    {
+        numerics.add_ids((long long)_random() << 12);
+        numerics.add_values(_random() / 3.0);
+        numerics.add_weights(_random() % 100 / 7.0f);
+        numerics.add_deltas((int)(_random() % 200) - 100);
+    }
+    cases.push_back({"numerics", "bench.Numerics", numerics.SerializeAsString(), LUA_NOREF});
+
+    bench::Blobs blobs;
+    blobs.set_payload(_randomstring(64 * 1024));
+    for (int i=0; i<16; i++) blobs.add_chunks(_randomstring(4096));
+    cases.push_back({"blobs", "bench.Blobs", blobs.SerializeAsString(), LUA_NOREF});
+
+    return cases;
+}
+
+// one call of op on a case, leaves the stack as it was
+static void _call(lua_State *L, int lib, const char* op, const Case& c)
+{
+    lua_getfield(L, lib, op);
+    lua_pushstring(L, c.type);
+    if (strcmp(op, "serialize") == 0) lua_rawgeti(L, LUA_REGISTRYINDEX, c.table);
+    else lua_pushlstring(L, c.data.data(), c.data.size());
+    if (lua_pcall(L, 2, 1, 0) != LUA_OK)
+    {
+        fprintf(stderr, "%s %s: %s\n", op, c.name, lua_tostring(L, -1));
+        exit(2);
+    }
+    lua_pop(L, 1);
+}
+
+static Result _run(lua_State *L, int lib, const char* op, const Case& c, double seconds)
+{
+    typedef std::chrono::steady_clock clock;
+    size_t count = 0, batch = 1, allocs, luabytes;
+    double elapsed;
+    Result r;
+
+    for (int i=0; i<16; i++) _call(L, lib, op, c);   //warm up plan and prototype caches
+    lua_gc(L, LUA_GCCOLLECT, 0);
+
+    allocs = g_allocs;
+    luabytes = g_luabytes;
+    auto start = clock::now();
+    do
+    {
+        for (size_t i=0; i<batch; i++) _call(L, lib, op, c);
+        count += batch;
+        if (batch < 1024) batch *= 2;
+        elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    } while (elapsed < seconds);
+
+    r.msgs = count / elapsed;
+    r.bytes = r.msgs * c.data.size();
+    r.allocs = (double)(g_allocs - allocs) / count;
+    r.luabytes = (double)(g_luabytes - luabytes) / count;
+    return r;
+}
+
+// "case op msgs bytes allocs luabytes" per line, as written by --save
+static std::map<std::string, Result> _loadbaseline(const char* path)
+{
+    std::map<std::string, Result> results;
+    char name[64], op[64];
+    Result r;
+
+    FILE* f = fopen(path, "r");
+    if (f == nullptr)
+    {
+        fprintf(stderr, "cannot open baseline %s\n", path);
+        exit(2);
+    }
+    while (fscanf(f, "%63s %63s %lf %lf %lf %lf", name, op, &r.msgs, &r.bytes, &r.allocs, &r.luabytes) == 6)
+        results[std::string(name) + " " + op] = r;
+    fclose(f);
+    return results;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* ops[] = {"serialize", "deserialize", "debugstr"};
+    const char *filter = nullptr, *save = nullptr, *baseline = nullptr;
+    double seconds = 1.0, threshold = 10.0;
+    std::map<std::string, Result> base;
+    bool regressed = false;
+
+    for (int i=1; i<argc; i++)
+    {
+        if (i+1 < argc && strcmp(argv[i], "--time") == 0) seconds = atof(argv[++i]);
+        else if (i+1 < argc && strcmp(argv[i], "--filter") == 0) filter = argv[++i];
+        else if (i+1 < argc && strcmp(argv[i], "--save") == 0) save = argv[++i];
+        else if (i+1 < argc && strcmp(argv[i], "--baseline") == 0) baseline = argv[++i];
+        else if (i+1 < argc && strcmp(argv[i], "--threshold") == 0) threshold = atof(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: %s [--time seconds] [--filter text] [--save file] [--baseline file] [--threshold percent]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (baseline) base = _loadbaseline(baseline);
+
+    lua_State *L = lua_newstate(_luaalloc, nullptr);
+    luaL_openlibs(L);
+    luaL_requiref(L, "proto.core", LuaModule::luaopen_proto_core, 0);
+    int lib = lua_gettop(L);
+
+    std::vector<Case> cases = _makecases();
+    for (auto& c : cases)                               //serialize starts from the table deserialize produces
+    {
+        lua_getfield(L, lib, "deserialize");
+        lua_pushstring(L, c.type);
+        lua_pushlstring(L, c.data.data(), c.data.size());
+        if (lua_pcall(L, 2, 1, 0) != LUA_OK || !lua_istable(L, -1))
+        {
+            fprintf(stderr, "cannot decode %s\n", c.name);
+            return 2;
+        }
+        c.table = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    FILE* out = save ? fopen(save, "w") : nullptr;
+    if (save && out == nullptr)
+    {
+        fprintf(stderr, "cannot write %s\n", save);
+        return 2;
+    }
+
+    printf("%-10s %-12s %8s %14s %12s %10s %12s", "case", "op", "bytes", "msgs/s", "MB/s", "allocs/op", "luabytes/op");
+    if (baseline) printf(" %9s", "vs base");
+    printf("\n");
+    for (auto& c : cases)
+    {
+        for (auto op : ops)
+        {
+            std::string key = std::string(c.name) + " " + op;
+            if (filter && key.find(filter) == std::string::npos) continue;
+
+            Result r = _run(L, lib, op, c, seconds);
+            printf("%-10s %-12s %8zu %14.0f %12.2f %10.1f %12.1f", c.name, op, c.data.size(), r.msgs, r.bytes / (1024 * 1024), r.allocs, r.luabytes);
+            if (out) fprintf(out, "%s %s %.2f %.2f %.3f %.3f\n", c.name, op, r.msgs, r.bytes, r.allocs, r.luabytes);
+
+            auto it = base.find(key);
+            if (it != base.end())
+            {
+                double change = (r.msgs / it->second.msgs - 1) * 100;
+                printf(" %+8.1f%%", change);
+                if (change < -threshold)
+                {
+                    printf(" slower");
+                    regressed = true;
+                }
+            }
+            printf("\n");
+        }
+    }
+
+    if (out) fclose(out);
+    for (auto& c : cases) luaL_unref(L, LUA_REGISTRYINDEX, c.table);
+    lua_close(L);
+    return regressed ? 1 : 0;
+}
@@ -0,0 +1,48 @@
+#include "tests.h"
+
+// option("arena"): serialize, deserialize and debugstr with their temporary message on the arena
+
+// deserialize callback: the table serialized again while the arena still holds the first message
+static int _reserialize(lua_State *L)
+{
+    lua_getfield(L, lua_upvalueindex(1), "serialize");
+    lua_pushstring(L, "tests.Node");
+    lua_pushvalue(L, 1);
+    lua_call(L, 2, 1);
+    return 1;
+}
+
+void _testarena(int rounds)
+{
+    int top = lua_gettop(L);
+
+    _option("arena", 256);                             //smaller than most messages, the arena has to grow
+    int n = _call("option", [&]{ lua_pushstring(L, "arena"); return 1; });
+    CHECK(n == 1 && lua_tointeger(L, -1) == 256);
+    lua_settop(L, top);
+
+    for (int i=0; i<rounds; i++)
+    {
+        tests::Node node;
+        _fillnode(&node, 3);
+        std::string data = node.SerializeAsString();
+
+        if (CHECK(_pushmsg(node))) CHECK(_serializesame(node, -1));
+        lua_settop(L, top);
+
+        n = _call("debugstr", [&]{ lua_pushstring(L, "tests.Node"); lua_pushlstring(L, data.data(), data.size()); return 2; });
+        CHECK(n == 1 && node.ShortDebugString() == lua_tostring(L, -1));
+        lua_settop(L, top);
+
+        n = _call("deserialize", [&]{
+            lua_pushstring(L, "tests.Node");
+            lua_pushlstring(L, data.data(), data.size());
+            lua_pushvalue(L, g_lib);
+            lua_pushcclosure(L, _reserialize, 1);
+            return 3;
+        });
+        CHECK(n == 1 && _parsesame(node, lua_tostring(L, -1), lua_rawlen(L, -1)));
+        lua_settop(L, top);
+    }
+    _option("arena", 0);
+}
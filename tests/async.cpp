@@ -0,0 +1,66 @@
+#include "tests.h"
+
+// handle at idx, method => number of results of handle:method()
+static int _method(int idx, const char* method)
+{
+    int base = lua_gettop(L);
+
+    idx = lua_absindex(L, idx);
+    lua_getmetatable(L, idx);
+    lua_getfield(L, -1, "__index");
+    lua_getfield(L, -1, method);
+    lua_replace(L, base + 1);
+    lua_settop(L, base + 1);
+    lua_pushvalue(L, idx);
+    if (lua_pcall(L, 1, LUA_MULTRET, 0) != LUA_OK)
+    {
+        fprintf(stderr, "%s: %s\n", method, lua_tostring(L, -1));
+        lua_settop(L, base);
+        return -1;
+    }
+    return lua_gettop(L) - base;
+}
+
+// deserialize_async handles, several in flight, against the messages they were given
+void _testasync(int rounds)
+{
+    static const int INFLIGHT = 8;
+    int top = lua_gettop(L);
+
+    for (int i=0; i<rounds; i++)
+    {
+        tests::Node nodes[INFLIGHT];
+        std::string data[INFLIGHT];
+
+        for (int j=0; j<INFLIGHT; j++)
+        {
+            _fillnode(&nodes[j], 3);
+            data[j] = nodes[j].SerializeAsString();
+            // odd ones by pointer, the string outlives the handle
+            int n = _call("deserialize_async", [&]{
+                lua_pushstring(L, "tests.Node");
+                if (j % 2 == 0) lua_pushlstring(L, data[j].data(), data[j].size());
+                else
+                {
+                    lua_pushlightuserdata(L, (void*)data[j].data());
+                    lua_pushinteger(L, data[j].size());
+                    return 3;
+                }
+                return 2;
+            });
+            if (!CHECK(n == 1 && lua_isuserdata(L, -1))) return;
+        }
+
+        for (int j=0; j<INFLIGHT; j++)
+        {
+            int handle = top + 1 + j;
+
+            if (!CHECK(_method(handle, "result") == 1 && lua_istable(L, -1) && _same("tests.Node", -1, nodes[j]))) continue;
+            CHECK(_method(handle, "ready") == 1 && lua_toboolean(L, -1));
+            lua_pop(L, 1);
+            CHECK(_method(handle, "result") == 1 && lua_rawequal(L, -1, -2));
+            lua_settop(L, top + INFLIGHT);
+        }
+        lua_settop(L, top);
+    }
+}
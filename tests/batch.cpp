@@ -0,0 +1,103 @@
+#include "tests.h"
+
+// deserialize_batch over varint length delimited records written by protobuf, serialize_batch read back by it
+
+static std::string _frame(const std::vector<tests::Node>& nodes, std::vector<size_t>* ends)
+{
+    std::string framed;
+    {
+        google::protobuf::io::StringOutputStream stream(&framed);
+        google::protobuf::io::CodedOutputStream output(&stream);
+        for (auto& node : nodes)
+        {
+            output.WriteVarint32((google::protobuf::uint32)node.ByteSizeLong());
+            node.SerializeWithCachedSizes(&output);
+            ends->push_back((size_t)output.ByteCount());
+        }
+    }
+    return framed;
+}
+
+// deserialize_batch results at top-1, top => the first count records of nodes, consumed bytes checked
+static void _checkrecords(int n, const std::vector<tests::Node>& nodes, size_t count, size_t consumed)
+{
+    if (!CHECK(n == 2 && lua_istable(L, -2))) return;
+    CHECK((size_t)lua_tointeger(L, -1) == consumed);
+    CHECK(lua_rawlen(L, -2) == count);
+    for (size_t i=0; i<count && i<lua_rawlen(L, -2); i++)
+    {
+        lua_rawgeti(L, -2, i + 1);
+        CHECK(_same("tests.Node", -1, nodes[i]));
+        lua_pop(L, 1);
+    }
+}
+
+// varint length delimited records => each parsed by protobuf and compared with nodes
+static bool _framedsame(const char* data, size_t size, const std::vector<tests::Node>& nodes)
+{
+    google::protobuf::io::CodedInputStream input((const google::protobuf::uint8*)data, (int)size);
+    for (auto& node : nodes)
+    {
+        google::protobuf::uint32 length;
+        std::string record;
+        if (!input.ReadVarint32(&length) || !input.ReadString(&record, (int)length)) return false;
+        if (!_parsesame(node, record.data(), record.size())) return false;
+    }
+    return input.ExpectAtEnd();
+}
+
+void _testbatch(int rounds)
+{
+    int top = lua_gettop(L);
+
+    for (int i=0; i<rounds; i++)
+    {
+        std::vector<tests::Node> nodes(_random() % 5);
+        std::vector<size_t> ends;
+        for (auto& node : nodes) _fillnode(&node, 2);
+        std::string framed = _frame(nodes, &ends);
+
+        int n = _call("deserialize_batch", [&]{ lua_pushstring(L, "tests.Node"); lua_pushlstring(L, framed.data(), framed.size()); return 2; });
+        _checkrecords(n, nodes, nodes.size(), framed.size());
+        lua_settop(L, top);
+
+        n = _call("deserialize_batch", [&]{ lua_pushstring(L, "tests.Node"); lua_pushlightuserdata(L, (void*)framed.data()); lua_pushinteger(L, framed.size()); return 3; });
+        _checkrecords(n, nodes, nodes.size(), framed.size());
+        lua_settop(L, top);
+
+        // serialize_batch writes the same framing, into a string or snprintf style into a buffer
+        lua_createtable(L, (int)nodes.size(), 0);
+        for (size_t j=0; j<nodes.size(); j++)
+        {
+            _pushmsg(nodes[j]);
+            lua_rawseti(L, top + 1, j + 1);
+        }
+        n = _call("serialize_batch", [&]{ lua_pushstring(L, "tests.Node"); lua_pushvalue(L, top + 1); return 2; });
+        CHECK(n == 1 && lua_type(L, -1) == LUA_TSTRING && _framedsame(lua_tostring(L, -1), lua_rawlen(L, -1), nodes));
+        lua_settop(L, top + 1);
+
+        std::vector<char> buffer(framed.size() + 1, '\x5a');
+        n = _call("serialize_batch", [&]{ lua_pushstring(L, "tests.Node"); lua_pushvalue(L, top + 1); lua_pushlightuserdata(L, buffer.data()); lua_pushinteger(L, buffer.size()); return 4; });
+        CHECK(n == 1 && (size_t)lua_tointeger(L, -1) == framed.size() && _framedsame(buffer.data(), framed.size(), nodes) && buffer.back() == '\x5a');
+        lua_settop(L, top + 1);
+        if (!framed.empty())
+        {
+            buffer.assign(framed.size() - 1, '\x5a');
+            n = _call("serialize_batch", [&]{ lua_pushstring(L, "tests.Node"); lua_pushvalue(L, top + 1); lua_pushlightuserdata(L, buffer.data()); lua_pushinteger(L, buffer.size()); return 4; });
+            CHECK(n == 1 && (size_t)lua_tointeger(L, -1) == framed.size() && std::string(buffer.begin(), buffer.end()) == std::string(buffer.size(), '\x5a'));
+        }
+        CHECK(_call("serialize_batch", [&]{ lua_pushstring(L, "tests.Node"); lua_pushvalue(L, top + 1); lua_pushlightuserdata(L, buffer.data()); lua_pushinteger(L, -1); return 4; }) == -1);
+        lua_settop(L, top);
+
+        if (nodes.size() < 2) continue;
+
+        // a count stops early, a cut last record just ends the batch
+        n = _call("deserialize_batch", [&]{ lua_pushstring(L, "tests.Node"); lua_pushlstring(L, framed.data(), framed.size()); lua_pushinteger(L, 1); return 3; });
+        _checkrecords(n, nodes, 1, ends[0]);
+        lua_settop(L, top);
+
+        n = _call("deserialize_batch", [&]{ lua_pushstring(L, "tests.Node"); lua_pushlstring(L, framed.data(), framed.size() - 1); return 2; });
+        _checkrecords(n, nodes, nodes.size() - 1, ends[nodes.size() - 2]);
+        lua_settop(L, top);
+    }
+}
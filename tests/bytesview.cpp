@@ -0,0 +1,69 @@
+#include "tests.h"
+
+// option("bytesview"): long bytes fields reach a deserialize callback as {lightuserdata, length} over the message
+
+static std::string g_raw, g_str;
+static int g_views;
+
+// deserialize callback: raw must be a view of g_raw when it is long enough, str always a string
+static int _look(lua_State *L)
+{
+    if (lua_getfield(L, 1, "raw") == LUA_TTABLE)
+    {
+        lua_rawgeti(L, -1, 1);
+        lua_rawgeti(L, -2, 2);
+        const void* p = lua_touserdata(L, -2);
+        size_t n = (size_t)lua_tointeger(L, -1);
+        CHECK(lua_type(L, -2) == LUA_TLIGHTUSERDATA && n == g_raw.size() && memcmp(p, g_raw.data(), n) == 0);
+        g_views++;
+        lua_pop(L, 2);
+    }
+    else CHECK(lua_type(L, -1) == LUA_TSTRING && g_raw == std::string(lua_tostring(L, -1), lua_rawlen(L, -1)));
+    lua_getfield(L, 1, "str");
+    CHECK(lua_type(L, -1) == LUA_TSTRING && g_str == lua_tostring(L, -1));
+    return 0;
+}
+
+static int _deserialize(const std::string& data, bool callback)
+{
+    return _call("deserialize", [&]{
+        lua_pushstring(L, "tests.Node");
+        lua_pushlstring(L, data.data(), data.size());
+        if (!callback) return 2;
+        lua_pushcfunction(L, _look);
+        return 3;
+    });
+}
+
+void _testbytesview()
+{
+    int top = lua_gettop(L);
+    tests::Node node;
+
+    _option("bytesview", 8);
+    for (size_t len : {0, 3, 7, 8, 64})
+    {
+        g_raw = std::string("\0\xff", 2) + std::string(len > 2 ? len - 2 : 0, 'r');
+        g_raw.resize(len);
+        g_str = std::string(len, 's');
+        node.set_raw(g_raw);
+        node.set_str(g_str);
+
+        g_views = 0;
+        CHECK(_deserialize(node.SerializeAsString(), true) == 0);
+        CHECK(g_views == (len >= 8 ? 1 : 0));
+
+        // only the callback form hands out views
+        if (CHECK(_deserialize(node.SerializeAsString(), false) == 1))
+        {
+            lua_getfield(L, -1, "raw");
+            CHECK(lua_type(L, -1) == LUA_TSTRING && g_raw == std::string(lua_tostring(L, -1), lua_rawlen(L, -1)));
+        }
+        lua_settop(L, top);
+    }
+    _option("bytesview", 0);
+
+    g_views = 0;
+    CHECK(_deserialize(node.SerializeAsString(), true) == 0 && g_views == 0);
+    lua_settop(L, top);
+}
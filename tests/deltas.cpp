@@ -0,0 +1,70 @@
+#include "tests.h"
+
+// serialize_delta(name, tbl, base) and apply_delta(name, base, delta), the base brought up to tbl
+
+// base table updated by the delta from base to next => next
+static void _checkdelta(const tests::Node& base, const tests::Node& next)
+{
+    int top = lua_gettop(L);
+    std::string a = base.SerializePartialAsString(), b = next.SerializePartialAsString();
+
+    _call("deserialize", [&]{ lua_pushstring(L, "tests.Node"); lua_pushlstring(L, a.data(), a.size()); return 2; });
+    int ta = lua_gettop(L);
+    _call("deserialize", [&]{ lua_pushstring(L, "tests.Node"); lua_pushlstring(L, b.data(), b.size()); return 2; });
+    int tb = lua_gettop(L);
+
+    int n = _call("serialize_delta", [&]{ lua_pushstring(L, "tests.Node"); lua_pushvalue(L, tb); lua_pushvalue(L, ta); return 3; });
+    if (!CHECK(n == 1 && lua_isstring(L, -1)))
+    {
+        lua_settop(L, top);
+        return;
+    }
+    std::string delta(lua_tostring(L, -1), lua_rawlen(L, -1));
+
+    n = _call("apply_delta", [&]{ lua_pushstring(L, "tests.Node"); lua_pushvalue(L, ta); lua_pushlstring(L, delta.data(), delta.size()); return 3; });
+    CHECK(n == 1 && lua_rawequal(L, -1, ta) && _same("tests.Node", ta, next));
+    lua_settop(L, top);
+}
+
+void _testdeltas(int rounds)
+{
+    for (int i=0; i<rounds; i++)
+    {
+        tests::Node base, next;
+        _fillnode(&base, 2);
+        if (i % 4) next = base;
+        _fillnode(&next, 2);
+        if (i % 5 == 0) next.Clear();
+        _checkdelta(base, next);
+    }
+
+    // a group member removed is cleared, not merged away
+    tests::Node base, next;
+    base.mutable_block()->set_x(1);
+    base.mutable_block()->set_y(2);
+    _fillleaf(base.mutable_block()->mutable_inner());
+    next = base;
+    next.mutable_block()->clear_y();
+    next.mutable_block()->mutable_inner()->clear_name();
+    next.mutable_block()->mutable_inner()->set_id(-1);
+    _checkdelta(base, next);
+
+    // the highest field number is a field like any other, not the cleared list
+    base.Clear();
+    base.set_last(3);
+    base.set_i32(4);
+    next.Clear();
+    next.set_last(5);
+    _checkdelta(base, next);
+    _checkdelta(next, base);
+
+    // a delta cut inside a tag is an error, not a shorter delta
+    int top = lua_gettop(L);
+    std::string data = next.SerializeAsString();
+    _call("deserialize", [&]{ lua_pushstring(L, "tests.Node"); lua_pushlstring(L, data.data(), data.size()); return 2; });
+    int table = lua_gettop(L);
+    _call("serialize_delta", [&]{ lua_pushstring(L, "tests.Node"); lua_pushvalue(L, table); lua_newtable(L); return 3; });
+    std::string cut = std::string(lua_tostring(L, -1), lua_rawlen(L, -1)) + "\xd0";
+    CHECK(_call("apply_delta", [&]{ lua_pushstring(L, "tests.Node"); lua_newtable(L); lua_pushlstring(L, cut.data(), cut.size()); return 3; }) == -1);
+    lua_settop(L, top);
+}
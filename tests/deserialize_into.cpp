@@ -0,0 +1,60 @@
+#include "tests.h"
+
+// field of the table at idx => its value at top
+static int _field(int idx, const char* name)
+{
+    lua_getfield(L, idx, name);
+    return lua_gettop(L);
+}
+
+// deserialize_into(name, data, tbl) => true when it gave tbl back
+static bool _into(const std::string& data, int tbl)
+{
+    int n = _call("deserialize_into", [&]{ lua_pushstring(L, "tests.Node"); lua_pushlstring(L, data.data(), data.size()); lua_pushvalue(L, tbl); return 3; });
+    bool ok = n == 1 && lua_rawequal(L, -1, tbl);
+    if (n > 0) lua_pop(L, n);
+    return ok;
+}
+
+// one table refilled by messages of different shapes: nested tables reused, stale entries gone
+void _testdeserializeinto(int rounds)
+{
+    int top = lua_gettop(L);
+
+    for (int i=0; i<rounds; i++)
+    {
+        tests::Node big, small;
+
+        _fillnode(&big, 3);
+        big.mutable_leaf()->set_id(1);
+        for (int j=0; j<3; j++) _fillleaf(big.add_leaves());
+        big.add_colors(tests::GREEN);
+        big.add_colors(tests::BLUE);
+        _fillnode(big.mutable_child(), 1);
+        _fillleaf(&(*big.mutable_named())["stale"]);
+        _fillleaf(small.mutable_leaf());
+        _fillleaf(small.add_leaves());
+        small.add_colors(tests::RED);
+        small.set_i32(i);
+
+        lua_newtable(L);
+        int tbl = lua_gettop(L);
+        if (!CHECK(_into(big.SerializeAsString(), tbl) && _same("tests.Node", tbl, big))) return;
+        int leaf = _field(tbl, "leaf");
+        int leaves = _field(tbl, "leaves");
+        int colors = _field(tbl, "colors");
+
+        if (!CHECK(_into(small.SerializeAsString(), tbl) && _same("tests.Node", tbl, small))) return;
+        _field(tbl, "leaf");
+        CHECK(lua_rawequal(L, -1, leaf));
+        _field(tbl, "leaves");
+        CHECK(lua_rawequal(L, -1, leaves) && lua_rawlen(L, leaves) == 1);
+        _field(tbl, "colors");
+        CHECK(lua_rawequal(L, -1, colors) && lua_rawlen(L, colors) == 1);
+        CHECK(lua_getfield(L, tbl, "child") == LUA_TNIL && lua_getfield(L, tbl, "named") == LUA_TNIL);
+
+        // and back, the shrunk arrays grow again
+        CHECK(_into(big.SerializeAsString(), tbl) && _same("tests.Node", tbl, big));
+        lua_settop(L, top);
+    }
+}
@@ -0,0 +1,86 @@
+#include "tests.h"
+
+// option("enum", name) => the mode it replaced
+static std::string _enummode(const char* mode)
+{
+    std::string old;
+
+    if (_call("option", [&]{ lua_pushstring(L, "enum"); lua_pushstring(L, mode); return 2; }) == 1) old = lua_tostring(L, -1);
+    lua_pop(L, 1);
+    return old;
+}
+
+// table at idx => true when its enum fields hold the numbers of node's
+static bool _numbers(int idx, const tests::Node& node)
+{
+    bool ok = true;
+    int top = lua_gettop(L);
+
+    idx = lua_absindex(L, idx);
+    lua_getfield(L, idx, "color");
+    ok = ok && lua_type(L, -1) == LUA_TNUMBER && lua_tointeger(L, -1) == node.color();
+    lua_getfield(L, idx, "colors");
+    for (int i=0; ok && i<node.colors_size(); i++)
+    {
+        lua_rawgeti(L, -1, i+1);
+        ok = lua_type(L, -1) == LUA_TNUMBER && lua_tointeger(L, -1) == node.colors(i);
+        lua_pop(L, 1);
+    }
+    lua_getfield(L, idx, "tints");
+    for (auto& kv : node.tints())
+    {
+        if (!ok) break;
+        lua_rawgeti(L, -1, kv.first);
+        ok = lua_type(L, -1) == LUA_TNUMBER && lua_tointeger(L, -1) == kv.second;
+        lua_pop(L, 1);
+    }
+    lua_settop(L, top);
+    return ok;
+}
+
+// option("enum", "number"): enum values come back as numbers, numbers and names both go back out
+void _testenummode(int rounds)
+{
+    int top = lua_gettop(L);
+
+    CHECK(_enummode("number") == "name");
+    for (int i=0; i<rounds; i++)
+    {
+        tests::Node node;
+
+        _fillnode(&node, 3);
+        node.set_color(tests::BLUE);
+        node.add_colors(tests::GREEN);
+        (*node.mutable_tints())[1] = tests::BLUE;
+        std::string data = node.SerializeAsString();
+        for (auto op : {"decode", "deserialize"})
+        {
+            int n = _call(op, [&]{ lua_pushstring(L, "tests.Node"); lua_pushlstring(L, data.data(), data.size()); return 2; });
+            if (!CHECK(n == 1 && lua_istable(L, -1) && _numbers(-1, node) && _same("tests.Node", -1, node) && _serializesame(node, -1))) fprintf(stderr, "  by %s\n", op);
+            lua_settop(L, top);
+        }
+    }
+
+    tests::Node want;
+    want.set_color(tests::BLUE);
+    want.add_colors(tests::GREEN);
+    want.add_colors(tests::BLUE);
+    (*want.mutable_tints())[2] = tests::RED;
+    lua_createtable(L, 0, 3);
+    lua_pushstring(L, "BLUE");
+    lua_setfield(L, -2, "color");
+    lua_createtable(L, 2, 0);
+    lua_pushstring(L, "GREEN");
+    lua_rawseti(L, -2, 1);
+    lua_pushinteger(L, tests::BLUE);
+    lua_rawseti(L, -2, 2);
+    lua_setfield(L, -2, "colors");
+    lua_createtable(L, 0, 1);
+    lua_pushstring(L, "RED");
+    lua_rawseti(L, -2, 2);
+    lua_setfield(L, -2, "tints");
+    CHECK(_same("tests.Node", -1, want) && _serializesame(want, -1));
+    lua_settop(L, top);
+
+    CHECK(_enummode("name") == "number");
+}
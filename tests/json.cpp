@@ -0,0 +1,79 @@
+#include "tests.h"
+#include <google/protobuf/util/json_util.h>
+
+// tojson against MessageToJsonString with the same options, fromjson read back by protobuf
+void _testjson(int rounds)
+{
+    static const char* flags[] = {"add_whitespace", "always_print_primitive_fields", "always_print_enums_as_ints", "preserve_proto_field_names"};
+    int top = lua_gettop(L);
+
+    for (int i=0; i<rounds; i++)
+    {
+        tests::Node node;
+        google::protobuf::util::JsonPrintOptions options;
+        std::string want;
+        int bits = i % 16;
+
+        _fillnode(&node, 3);
+        options.add_whitespace = bits & 1;
+        options.always_print_primitive_fields = bits & 2;
+        options.always_print_enums_as_ints = bits & 4;
+        options.preserve_proto_field_names = bits & 8;
+        if (!CHECK(google::protobuf::util::MessageToJsonString(node, &want, options).ok())) continue;
+
+        std::string data = node.SerializeAsString();
+        int n = _call("tojson", [&]{
+            lua_pushstring(L, "tests.Node");
+            lua_pushlstring(L, data.data(), data.size());
+            lua_createtable(L, 0, 4);
+            for (int j=0; j<4; j++)
+            {
+                lua_pushboolean(L, bits & (1 << j));
+                lua_setfield(L, -2, flags[j]);
+            }
+            return 3;
+        });
+        if (!CHECK(n == 1 && lua_type(L, -1) == LUA_TSTRING && want == lua_tostring(L, -1))) fprintf(stderr, "  got  %s\n  want %s\n", n == 1 ? lua_tostring(L, -1) : "", want.c_str());
+        lua_settop(L, top);
+
+        // protobuf's json drops groups and reads printed defaults as set, so the reference is its own parse of the text
+        tests::Node back;
+        if (!CHECK(google::protobuf::util::JsonStringToMessage(want, &back).ok())) continue;
+        n = _call("fromjson", [&]{ lua_pushstring(L, "tests.Node"); lua_pushlstring(L, want.data(), want.size()); return 2; });
+        CHECK(n == 1 && lua_type(L, -1) == LUA_TSTRING && _parsesame(back, lua_tostring(L, -1), lua_rawlen(L, -1)));
+        lua_settop(L, top);
+    }
+
+    // without groups or printed defaults the text goes back to the same message
+    for (int i=0; i<rounds; i++)
+    {
+        tests3::Flat flat;
+
+        _fillflat(&flat);
+        std::string data = flat.SerializeAsString();
+        if (!CHECK(_call("tojson", [&]{ lua_pushstring(L, "tests3.Flat"); lua_pushlstring(L, data.data(), data.size()); return 2; }) == 1)) continue;
+        std::string text(lua_tostring(L, -1), lua_rawlen(L, -1));
+        lua_settop(L, top);
+        int n = _call("fromjson", [&]{ lua_pushstring(L, "tests3.Flat"); lua_pushlstring(L, text.data(), text.size()); return 2; });
+        CHECK(n == 1 && lua_type(L, -1) == LUA_TSTRING && _parsesame(flat, lua_tostring(L, -1), lua_rawlen(L, -1)));
+        lua_settop(L, top);
+    }
+
+    // a field the type does not have is a reason unless asked to skip it
+    std::string json = "{\"i32\": 3, \"nosuch\": 1}";
+    tests::Node want;
+    want.set_i32(3);
+    int n = _call("fromjson", [&]{ lua_pushstring(L, "tests.Node"); lua_pushlstring(L, json.data(), json.size()); return 2; });
+    CHECK(n == 2 && lua_isnil(L, -2) && lua_isstring(L, -1));
+    lua_settop(L, top);
+    n = _call("fromjson", [&]{
+        lua_pushstring(L, "tests.Node");
+        lua_pushlstring(L, json.data(), json.size());
+        lua_createtable(L, 0, 1);
+        lua_pushboolean(L, 1);
+        lua_setfield(L, -2, "ignore_unknown_fields");
+        return 3;
+    });
+    CHECK(n == 1 && _parsesame(want, lua_tostring(L, -1), lua_rawlen(L, -1)));
+    lua_settop(L, top);
+}
@@ -0,0 +1,114 @@
+#include "tests.h"
+
+// deserialize_lazy proxies read field by field against protobuf's parse of the same data
+
+// lazy proxy at idx => plain table at top, sub message proxies converted too
+static void _materialize(int idx)
+{
+    idx = lua_absindex(L, idx);
+    lua_newtable(L);
+    int out = lua_gettop(L);
+    lua_getmetatable(L, idx);
+    lua_getfield(L, -1, "__next");
+    int next = lua_gettop(L);
+
+    lua_pushnil(L);
+    for (;;)
+    {
+        lua_pushvalue(L, next);
+        lua_pushvalue(L, idx);
+        lua_pushvalue(L, -3);
+        lua_call(L, 2, 2);                              //key, next key, value
+        if (lua_isnil(L, -2)) break;
+        if (lua_type(L, -1) == LUA_TUSERDATA)
+        {
+            _materialize(-1);
+            lua_remove(L, -2);
+        }
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, out);
+        lua_remove(L, -2);
+    }
+    lua_settop(L, out);
+}
+
+// proxy at idx, key => its __index result at top
+static void _index(int idx, const char* key)
+{
+    idx = lua_absindex(L, idx);
+    lua_getmetatable(L, idx);
+    lua_getfield(L, -1, "__index");
+    lua_remove(L, -2);
+    lua_pushvalue(L, idx);
+    lua_pushstring(L, key);
+    lua_call(L, 2, 1);
+}
+
+template <class M> static void _checklazy(const char* type, const std::string& data)
+{
+    int top = lua_gettop(L);
+    M want;
+
+    want.ParsePartialFromString(data);
+    want.DiscardUnknownFields();
+    int n = _call("deserialize_lazy", [&]{ lua_pushstring(L, type); lua_pushlstring(L, data.data(), data.size()); return 2; });
+    if (CHECK(n == 1 && lua_type(L, -1) == LUA_TUSERDATA))
+    {
+        _materialize(-1);
+        CHECK(_same(type, -1, want));
+    }
+    lua_settop(L, top);
+}
+
+void _testlazy(int rounds)
+{
+    int top = lua_gettop(L);
+
+    for (int i=0; i<rounds; i++)
+    {
+        tests::Node a, b;
+        _fillnode(&a, 3);
+        _checklazy<tests::Node>("tests.Node", a.SerializeAsString());
+        _fillnode(&b, 2);
+        _checklazy<tests::Node>("tests.Node", a.SerializeAsString() + b.SerializeAsString());
+
+        tests3::Flat flat;
+        _fillflat(&flat);
+        _checklazy<tests3::Flat>("tests3.Flat", flat.SerializeAsString());
+    }
+
+    // unknown proto2 enum values are dropped, proto3 ones read as numbers, missing required fields left out
+    tests::Wide wide;
+    wide.set_color(3);
+    wide.add_colors(3);
+    wide.add_colors(5);
+    (*wide.mutable_tints())[1] = 3;
+    _checklazy<tests::Node>("tests.Node", wide.SerializeAsString());
+    tests3::Flat flat;
+    flat.set_mode((tests3::Mode)3);
+    _checklazy<tests3::Flat>("tests3.Flat", flat.SerializeAsString());
+    tests::Node partial;
+    partial.mutable_leaf()->set_name("x");
+    partial.mutable_block()->mutable_inner();
+    _checklazy<tests::Node>("tests.Node", partial.SerializePartialAsString());
+
+    // single fields through __index: scalars, unset fields, sub message proxies
+    tests::Node node;
+    node.set_i32(-5);
+    node.mutable_child()->set_str("deep");
+    std::string data = node.SerializeAsString();
+    _call("deserialize_lazy", [&]{ lua_pushstring(L, "tests.Node"); lua_pushlstring(L, data.data(), data.size()); return 2; });
+    int proxy = lua_gettop(L);
+    _index(proxy, "i32");
+    CHECK(lua_tointeger(L, -1) == -5);
+    _index(proxy, "str");
+    CHECK(lua_isnil(L, -1));
+    _index(proxy, "child");
+    if (CHECK(lua_type(L, -1) == LUA_TUSERDATA))
+    {
+        _index(-1, "str");
+        CHECK(lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), "deep") == 0);
+    }
+    lua_settop(L, top);
+}
@@ -0,0 +1,71 @@
+#include "tests.h"
+#include <google/protobuf/descriptor.pb.h>
+
+// lib[op] of the module at lib, like _call
+template <class F> static int _libcall(int lib, const char* op, F args)
+{
+    int base = lua_gettop(L);
+
+    lua_getfield(L, lib, op);
+    int n = args();
+    if (lua_pcall(L, n, LUA_MULTRET, 0) != LUA_OK)
+    {
+        fprintf(stderr, "%s: %s\n", op, lua_tostring(L, -1));
+        lua_settop(L, base);
+        return -1;
+    }
+    return lua_gettop(L) - base;
+}
+
+// load(fdset) of tests.proto against the generated classes it was compiled into
+void _testload(int rounds)
+{
+    google::protobuf::FileDescriptorSet files;
+    int top = lua_gettop(L);
+
+    tests::Node::descriptor()->file()->CopyTo(files.add_file());
+    std::string fdset = files.SerializeAsString();
+    if (!CHECK(_call("load", [&]{ lua_pushlstring(L, fdset.data(), fdset.size()); return 1; }) == 1 && lua_istable(L, -1))) return;
+    int lib = lua_gettop(L);
+
+    for (int i=0; i<rounds; i++)
+    {
+        tests::Node node;
+
+        _fillnode(&node, 3);
+        std::string data = node.SerializeAsString();
+        for (auto op : {"decode", "deserialize"})
+        {
+            int n = _libcall(lib, op, [&]{ lua_pushstring(L, "tests.Node"); lua_pushlstring(L, data.data(), data.size()); return 2; });
+            if (!CHECK(n == 1 && lua_istable(L, -1) && _same("tests.Node", -1, node))) fprintf(stderr, "  by %s\n", op);
+            lua_settop(L, lib);
+        }
+
+        if (!CHECK(_pushmsg(node))) continue;
+        for (auto op : {"encode", "serialize"})
+        {
+            int n = _libcall(lib, op, [&]{ lua_pushstring(L, "tests.Node"); lua_pushvalue(L, lib + 1); return 2; });
+            if (!CHECK(n == 1 && lua_type(L, -1) == LUA_TSTRING && _parsesame(node, lua_tostring(L, -1), lua_rawlen(L, -1)))) fprintf(stderr, "  by %s\n", op);
+            lua_settop(L, lib + 1);
+        }
+        lua_settop(L, lib);
+    }
+
+    // options of the loaded module leave this one alone
+    _libcall(lib, "option", [&]{ lua_pushstring(L, "enum"); lua_pushstring(L, "number"); return 2; });
+    _call("option", [&]{ lua_pushstring(L, "enum"); return 1; });
+    CHECK(strcmp(lua_tostring(L, -1), "name") == 0);
+    lua_settop(L, top);
+
+    // neither bad bytes nor a file missing its imports load
+    google::protobuf::FileDescriptorSet partial;
+    tests3::Flat::descriptor()->file()->CopyTo(partial.add_file());
+    partial.mutable_file(0)->add_dependency("missing.proto");
+    for (std::string bad : {std::string("\xff"), partial.SerializeAsString()})
+    {
+        lua_getfield(L, g_lib, "load");
+        lua_pushlstring(L, bad.data(), bad.size());
+        CHECK(lua_pcall(L, 1, 1, 0) != LUA_OK && _startswith(lua_tostring(L, -1), "Invalid FileDescriptorSet"));
+        lua_settop(L, top);
+    }
+}
@@ -0,0 +1,47 @@
+#include "tests.h"
+#include <google/protobuf/field_mask.pb.h>
+#include <google/protobuf/util/field_mask_util.h>
+
+// deserialize(name, data, fields) against FieldMaskUtil::TrimMessage
+void _testmasks(int rounds)
+{
+    static const std::vector<std::vector<const char*>> masks = {
+        {"i32"},
+        {"leaf.id", "str"},
+        {"block.x", "block.inner.name"},
+        {"leaves", "item"},
+        {"named", "tints", "colors"},
+        {"child.leaf", "child.i32", "child.child.block"},
+        {"pick", "last"},
+    };
+    int top = lua_gettop(L);
+
+    for (int i=0; i<rounds; i++)
+    {
+        for (auto& paths : masks)
+        {
+            tests::Node node, want;
+            google::protobuf::FieldMask mask;
+
+            _fillnode(&node, 3);
+            std::string data = node.SerializeAsString();
+            for (auto path : paths) mask.add_paths(path);
+            want = node;
+            google::protobuf::util::FieldMaskUtil::TrimMessage(mask, &want);
+
+            int n = _call("deserialize", [&]{
+                lua_pushstring(L, "tests.Node");
+                lua_pushlstring(L, data.data(), data.size());
+                lua_createtable(L, (int)paths.size(), 0);
+                for (size_t j=0; j<paths.size(); j++)
+                {
+                    lua_pushstring(L, paths[j]);
+                    lua_rawseti(L, -2, j+1);
+                }
+                return 3;
+            });
+            if (!CHECK(n == 1 && lua_istable(L, -1) && _same("tests.Node", -1, want))) fprintf(stderr, "  mask %s\n", mask.ShortDebugString().c_str());
+            lua_settop(L, top);
+        }
+    }
+}
@@ -0,0 +1,48 @@
+#include "tests.h"
+
+// option("pool"): messages cleared and reused across calls, so nothing of one call may leak into the next
+
+static std::string g_seen;
+
+// serialize callback: what the message handed out holds
+static int _keep(lua_State *L)
+{
+    g_seen = ((const google::protobuf::Message*)lua_touserdata(L, 1))->SerializeAsString();
+    return 0;
+}
+
+static void _poolstats(lua_Integer* hits, lua_Integer* misses)
+{
+    _call("poolstats", []{ return 0; });
+    *hits = lua_tointeger(L, -2);
+    *misses = lua_tointeger(L, -1);
+    lua_pop(L, 2);
+}
+
+void _testpool(int rounds)
+{
+    int top = lua_gettop(L);
+    lua_Integer hits, misses, hits2, misses2;
+
+    _option("pool", 2);
+    _poolstats(&hits, &misses);
+    for (int i=0; i<rounds; i++)
+    {
+        tests::Node node;
+        _fillnode(&node, 3);
+        if (i % 3 == 0) node.Clear();               //after a full message, an empty one must come out empty
+
+        if (CHECK(_pushmsg(node))) CHECK(_serializesame(node, -1));
+        int t = lua_gettop(L);
+
+        g_seen.clear();
+        int n = _call("serialize", [&]{ lua_pushstring(L, "tests.Node"); lua_pushvalue(L, t); lua_pushcfunction(L, _keep); return 3; });
+        tests::Node got;
+        CHECK(n == 0 && got.ParseFromString(g_seen) && google::protobuf::util::MessageDifferencer::Equals(got, node));
+        lua_settop(L, top);
+    }
+    _poolstats(&hits2, &misses2);
+    CHECK(hits2 - hits >= rounds * 2);
+    CHECK(misses2 - misses <= 2);
+    _option("pool", 0);
+}
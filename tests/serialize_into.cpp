@@ -0,0 +1,45 @@
+#include "tests.h"
+
+// serialize_into(name, tbl, ptr, size) against protobuf, snprintf style sizes included
+
+static int _into(const char* type, int idx, void* ptr, lua_Integer cap)
+{
+    idx = lua_absindex(L, idx);
+    return _call("serialize_into", [&]{ lua_pushstring(L, type); lua_pushvalue(L, idx); lua_pushlightuserdata(L, ptr); lua_pushinteger(L, cap); return 4; });
+}
+
+void _testserializeinto(int rounds)
+{
+    int top = lua_gettop(L);
+
+    for (int i=0; i<rounds; i++)
+    {
+        tests::Node node;
+        _fillnode(&node, 2);
+        if (!CHECK(_pushmsg(node))) continue;
+
+        size_t size = node.ByteSizeLong();
+        std::vector<char> buffer(size + 8, '\x5a');
+        int n = _into("tests.Node", -1, buffer.data(), (lua_Integer)buffer.size());
+        CHECK(n == 1 && lua_tointeger(L, -1) == (lua_Integer)size && _parsesame(node, buffer.data(), size));
+        CHECK(buffer[size] == '\x5a');
+        lua_settop(L, top + 1);
+
+        // too small: the size comes back and nothing is written
+        if (size > 0)
+        {
+            std::vector<char> small(size - 1, '\x5a');
+            n = _into("tests.Node", -1, small.data(), (lua_Integer)small.size());
+            CHECK(n == 1 && lua_tointeger(L, -1) == (lua_Integer)size && std::string(small.begin(), small.end()) == std::string(size - 1, '\x5a'));
+        }
+        lua_settop(L, top);
+    }
+
+    char c = 0;
+    lua_newtable(L);
+    CHECK(_into("tests.Node", -1, &c, 0) == 1 && lua_tointeger(L, -1) == 0);
+    lua_settop(L, top + 1);
+    CHECK(_into("tests.Node", -1, &c, -1) == -1);
+    CHECK(_call("serialize_into", [&]{ lua_pushstring(L, "tests.Node"); lua_pushvalue(L, top + 1); lua_pushstring(L, "buffer"); lua_pushinteger(L, 16); return 4; }) == -1);
+    lua_settop(L, top);
+}
@@ -0,0 +1,85 @@
+#include "tests.h"
+
+// stats(reset)["tests.Node"][counter], 0 when the type has no entry
+static lua_Integer _stat(const char* counter, bool reset = false)
+{
+    int top = lua_gettop(L);
+    lua_Integer value = 0;
+
+    if (_call("stats", [&]{ lua_pushboolean(L, reset); return 1; }) == 1 && lua_getfield(L, -1, "tests.Node") == LUA_TTABLE)
+    {
+        lua_getfield(L, -1, counter);
+        value = lua_tointeger(L, -1);
+    }
+    lua_settop(L, top);
+    return value;
+}
+
+// the counters of one call, zeroed after => true when they are the ones given
+static bool _counted(lua_Integer encodes, lua_Integer decodes, lua_Integer bytesout, lua_Integer bytesin)
+{
+    bool ok = _stat("encodes") == encodes && _stat("decodes") == decodes && _stat("bytesout") == bytesout && _stat("bytesin") == bytesin;
+    _stat("encodes", true);
+    return ok;
+}
+
+// option("stats"), every codec call counted once per message it converts
+void _teststats()
+{
+    static const char* decoders[] = {"decode", "deserialize", "deserialize_into", "deserialize_lazy", "async", "stream", "debugstr"};
+    tests::Node node;
+    int top = lua_gettop(L);
+
+    _fillnode(&node, 3);
+    std::string data = node.SerializeAsString();
+    lua_Integer size = (lua_Integer)data.size();
+
+    _call("option", [&]{ lua_pushstring(L, "stats"); lua_pushboolean(L, 1); return 2; });
+    CHECK(!lua_toboolean(L, -1));
+    lua_settop(L, top);
+    _stat("encodes", true);
+
+    for (auto op : decoders)
+    {
+        if (!CHECK(_run(op, "tests.Node", data) == "" && _counted(0, 1, 0, size))) fprintf(stderr, "  by %s\n", op);
+    }
+
+    _pushmsg(node);
+    int tbl = lua_gettop(L);
+    _stat("encodes", true);
+    for (auto op : {"encode", "serialize"})
+    {
+        _call(op, [&]{ lua_pushstring(L, "tests.Node"); lua_pushvalue(L, tbl); return 2; });
+        if (!CHECK(_counted(1, 0, size, 0))) fprintf(stderr, "  by %s\n", op);
+        lua_settop(L, tbl);
+    }
+
+    // a batch counts its records, not its calls, and the bytes with their length prefixes
+    lua_createtable(L, 3, 0);
+    for (int i=1; i<=3; i++)
+    {
+        lua_pushvalue(L, tbl);
+        lua_rawseti(L, -2, i);
+    }
+    int records = lua_gettop(L);
+    _call("serialize_batch", [&]{ lua_pushstring(L, "tests.Node"); lua_pushvalue(L, records); return 2; });
+    std::string framed(lua_tostring(L, -1), lua_rawlen(L, -1));
+    CHECK(_counted(3, 0, (lua_Integer)framed.size(), 0));
+    _call("deserialize_batch", [&]{ lua_pushstring(L, "tests.Node"); lua_pushlstring(L, framed.data(), framed.size()); return 2; });
+    CHECK(_counted(0, 3, 0, (lua_Integer)framed.size()));
+
+    // a delta from an empty base and back
+    _call("serialize_delta", [&]{ lua_pushstring(L, "tests.Node"); lua_pushvalue(L, tbl); lua_newtable(L); return 3; });
+    std::string delta(lua_tostring(L, -1), lua_rawlen(L, -1));
+    CHECK(_stat("encodes") == 1 && _stat("bytesout") == (lua_Integer)delta.size());
+    _call("apply_delta", [&]{ lua_pushstring(L, "tests.Node"); lua_newtable(L); lua_pushlstring(L, delta.data(), delta.size()); return 3; });
+    CHECK(_counted(1, 1, (lua_Integer)delta.size(), (lua_Integer)delta.size()));
+    lua_settop(L, top);
+
+    // json skips the table and is left out, as is everything with the option off
+    CHECK(_call("tojson", [&]{ lua_pushstring(L, "tests.Node"); lua_pushlstring(L, data.data(), data.size()); return 2; }) == 1 && _counted(0, 0, 0, 0));
+    _call("option", [&]{ lua_pushstring(L, "stats"); lua_pushboolean(L, 0); return 2; });
+    CHECK(lua_toboolean(L, -1));
+    lua_settop(L, top);
+    CHECK(_run("decode", "tests.Node", data) == "" && _counted(0, 0, 0, 0));
+}
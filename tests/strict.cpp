@@ -0,0 +1,80 @@
+#include "tests.h"
+
+// option("strict") and its limits over every decoding call, through _run
+void _teststrict()
+{
+    static const char* ops[] = {"deserialize", "deserialize_into", "debugstr", "decode", "deserialize_lazy", "batch", "async", "stream", "mask"};
+    tests::Node node, deep, missing, many;
+    std::string reason;
+
+    _fillnode(&node, 2);
+    for (int i=0; i<5; i++) node.add_leaves()->set_id(i);
+    tests::Node* pNode = &deep;
+    for (int i=0; i<12; i++) pNode = pNode->mutable_child();
+    missing.mutable_block()->mutable_inner()->set_name("no id");
+    for (int i=0; i<10; i++) many.add_item()->set_k(i);
+    std::string interleaved, nested;                  //map entries with another field between each of them, at the top and in child
+    for (int i=0; i<6; i++)
+    {
+        tests::Node part;
+        part.set_i32(i);
+        (*part.mutable_tints())[i] = tests::GREEN;
+        interleaved += part.SerializeAsString();
+    }
+    {
+        google::protobuf::io::StringOutputStream stream(&nested);
+        google::protobuf::io::CodedOutputStream output(&stream);
+        output.WriteTag(google::protobuf::internal::WireFormatLite::MakeTag(24, google::protobuf::internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
+        output.WriteVarint32((google::protobuf::uint32)interleaved.size());
+        output.WriteString(interleaved);
+    }
+
+    std::string good = node.SerializeAsString(), bad = good + "\x08";
+    _strict(true);
+    for (auto op : ops)
+    {
+        const char* mask = strcmp(op, "mask") == 0 ? "block" : nullptr;
+
+        reason = _run(op, "tests.Node", good, mask);
+        if (!CHECK(reason == "")) fprintf(stderr, "  %s: %s\n", op, reason.c_str());
+        CHECK(_run(op, "tests.Node", bad, mask) == "malformed message");
+        reason = _run(op, "tests.Node", missing.SerializePartialAsString(), mask);
+        if (!CHECK(_startswith(reason, "missing required fields"))) fprintf(stderr, "  %s: %s\n", op, reason.c_str());
+
+        _option("maxsize", 10);
+        CHECK(_run(op, "tests.Node", good, mask) == "message too large");
+        _option("maxsize", 0);
+
+        _option("maxdepth", 5);
+        CHECK(_run(op, "tests.Node", deep.SerializeAsString(), mask ? "child" : nullptr) == "malformed message");
+        _option("maxdepth", 0);
+
+        _option("maxrepeated", 8);
+        CHECK(_run(op, "tests.Node", good, mask ? "leaves" : nullptr) == "");
+        reason = _run(op, "tests.Node", many.SerializeAsString(), mask ? "item" : nullptr);
+        if (!CHECK(reason == "too many repeated elements")) fprintf(stderr, "  %s: %s\n", op, reason.c_str());
+        _option("maxrepeated", 3);
+        reason = _run(op, "tests.Node", interleaved, mask ? "tints" : nullptr);
+        if (!CHECK(reason == "too many repeated elements")) fprintf(stderr, "  %s: interleaved %s\n", op, reason.c_str());
+        reason = _run(op, "tests.Node", nested, mask ? "child" : nullptr);
+        if (!CHECK(reason == "too many repeated elements")) fprintf(stderr, "  %s: nested %s\n", op, reason.c_str());
+        _option("maxrepeated", 6);
+        CHECK(_run(op, "tests.Node", interleaved, mask ? "tints" : nullptr) == "");
+        CHECK(_run(op, "tests.Node", nested, mask ? "child" : nullptr) == "");
+        _option("maxrepeated", 0);
+    }
+
+    // a field mask leaves unselected required fields unchecked
+    CHECK(_run("mask", "tests.Node", missing.SerializePartialAsString(), "i32") == "");
+
+    // proto3 strings must be valid UTF-8
+    tests3::Flat flat;
+    flat.set_i(1);
+    std::string text = flat.SerializeAsString() + std::string("\x12\x02\xc3\x28", 4);
+    CHECK(_run("deserialize", "tests3.Flat", text) == "malformed message");
+    CHECK(_run("decode", "tests3.Flat", text) == "malformed message");
+    _strict(false);
+
+    CHECK(_run("deserialize", "tests.Node", missing.SerializePartialAsString()) == "");
+    CHECK(_run("decode", "tests.Node", missing.SerializePartialAsString()) == "");
+}
@@ -0,0 +1,411 @@
+#include "tests.h"
+#include <cstdlib>
+#include <memory>
+
+// the wire decoder and the reflection path checked against protobuf's own parse, the other parts in a file each
+// usage: luaproto_tests [--rounds n]
+
+namespace LuaModule {
+    int luaopen_proto_core(lua_State *L);
+}
+
+lua_State *L;
+int g_lib;
+static int g_pass = 0, g_fail = 0;
+
+bool _check(bool ok, const char* what, const char* file, int line)
+{
+    if (ok) g_pass++;
+    else
+    {
+        g_fail++;
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+    }
+    return ok;
+}
+
+unsigned _random()
+{
+    static unsigned seed = 12345;
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+std::string _randomstring(size_t len)
+{
+    std::string s(len, ' ');
+    for (auto& c : s) c = 'a' + _random() % 26;
+    return s;
+}
+
+void _option(const char* name, lua_Integer value)
+{
+    _call("option", [&]{ lua_pushstring(L, name); lua_pushinteger(L, value); return 2; });
+    lua_pop(L, 1);
+}
+
+void _strict(bool on)
+{
+    _call("option", [&]{ lua_pushstring(L, "strict"); lua_pushboolean(L, on); return 2; });
+    lua_pop(L, 1);
+}
+
+void _fillleaf(tests::Leaf* pLeaf)
+{
+    pLeaf->set_id(_random() % 1000);
+    if (_random() % 2) pLeaf->set_name(_randomstring(_random() % 8));
+    for (unsigned i=0, n=_random() % 4; i<n; i++) pLeaf->add_values((int)(_random() % 100) - 50);
+}
+
+tests::Color _color()
+{
+    static const tests::Color colors[] = {tests::RED, tests::GREEN, tests::BLUE};
+    return colors[_random() % 3];
+}
+
+void _fillnode(tests::Node* pNode, int depth)
+{
+    if (_random() % 2) pNode->set_i32((int)_random() - (1 << 23));
+    if (_random() % 2) pNode->set_s64(-((long long)_random() << 8));
+    if (_random() % 2) pNode->set_f32(_random());
+    if (_random() % 2) pNode->set_d(_random() / 7.0);
+    if (_random() % 2) pNode->set_b(_random() % 2 == 0);
+    if (_random() % 2) pNode->set_str(_randomstring(_random() % 16));
+    if (_random() % 2) pNode->set_raw(std::string("\0\xff\x80", 3) + _randomstring(_random() % 8));
+    if (_random() % 2) pNode->set_color(_color());
+    for (unsigned i=0, n=_random() % 4; i<n; i++) pNode->add_colors(_color());
+    for (unsigned i=0, n=_random() % 4; i<n; i++) pNode->add_packed_colors(_color());
+    if (_random() % 2) _fillleaf(pNode->mutable_leaf());
+    for (unsigned i=0, n=_random() % 3; i<n; i++) _fillleaf(pNode->add_leaves());
+    for (unsigned i=0, n=_random() % 3; i<n; i++) _fillleaf(&(*pNode->mutable_named())[_randomstring(4)]);
+    for (unsigned i=0, n=_random() % 3; i<n; i++) (*pNode->mutable_tints())[_random() % 100] = _color();
+    if (_random() % 2)
+    {
+        auto pBlock = pNode->mutable_block();
+        if (_random() % 2) pBlock->set_x(_random() % 100);
+        if (_random() % 2) pBlock->set_y(_random() % 100);
+        if (_random() % 2) _fillleaf(pBlock->mutable_inner());
+    }
+    for (unsigned i=0, n=_random() % 3; i<n; i++) pNode->add_item()->set_k(_random() % 100);
+    switch (_random() % 4)
+    {
+        case 1: pNode->set_num(_random() % 100); break;
+        case 2: pNode->set_text(_randomstring(5)); break;
+        case 3: _fillleaf(pNode->mutable_pick()); break;
+        default: break;
+    }
+    if (depth > 0 && _random() % 2) _fillnode(pNode->mutable_child(), depth - 1);
+    for (unsigned i=0, n=_random() % 5; i<n; i++) pNode->add_deltas((int)(_random() % 2000) - 1000);
+    for (unsigned i=0, n=_random() % 3; i<n; i++) pNode->add_stamps((unsigned long long)_random() << 20);
+    if (_random() % 3 == 0) pNode->set_fallback(_random() % 10);
+    if (_random() % 3 == 0) pNode->set_last(_random() % 10);
+}
+
+void _fillflat(tests3::Flat* pFlat)
+{
+    if (_random() % 2) pFlat->set_i((int)_random() - (1 << 23));
+    if (_random() % 2) pFlat->set_s(_randomstring(_random() % 10));
+    for (unsigned i=0, n=_random() % 4; i<n; i++) pFlat->add_r((long long)_random() << 10);
+    if (_random() % 2) pFlat->mutable_sub()->set_a(_random() % 10);
+    if (_random() % 2) pFlat->set_mode(tests3::ONE);
+    for (unsigned i=0, n=_random() % 3; i<n; i++) (*pFlat->mutable_m())[_randomstring(3)] = _random();
+    if (_random() % 3 == 0) pFlat->set_oi(0);
+    else if (_random() % 2) pFlat->set_os(_randomstring(3));
+    if (_random() % 2) pFlat->set_b(_randomstring(4));
+    for (unsigned i=0, n=_random() % 3; i<n; i++) pFlat->add_subs()->set_s(_randomstring(2));
+}
+
+// data through decode and deserialize, each compared with protobuf's parse of it
+template <class M> static void _checkpaths(const char* type, const std::string& data)
+{
+    int top = lua_gettop(L);
+    M want;
+
+    want.ParsePartialFromString(data);
+    want.DiscardUnknownFields();
+    for (auto op : {"decode", "deserialize"})
+    {
+        int n = _call(op, [&]{ lua_pushstring(L, type); lua_pushlstring(L, data.data(), data.size()); return 2; });
+        if (!CHECK(n == 1 && lua_istable(L, -1) && _same(type, -1, want))) fprintf(stderr, "  by %s\n", op);
+        lua_settop(L, top);
+    }
+}
+
+static void _testpaths(int rounds)
+{
+    for (int i=0; i<rounds; i++)
+    {
+        tests::Node node;
+        _fillnode(&node, 3);
+        _checkpaths<tests::Node>("tests.Node", node.SerializeAsString());
+
+        tests3::Flat flat;
+        _fillflat(&flat);
+        _checkpaths<tests3::Flat>("tests3.Flat", flat.SerializeAsString());
+    }
+
+    // repeated occurrences of a sub message or a group merge, the last scalar wins
+    tests::Node a, b;
+    _fillnode(&a, 2);
+    _fillnode(&b, 2);
+    _checkpaths<tests::Node>("tests.Node", a.SerializeAsString() + b.SerializeAsString());
+}
+
+// proto2 enums are closed: unknown values are dropped and never replace a known one
+static void _testenums()
+{
+    tests::Wide wide;
+    int top = lua_gettop(L);
+
+    wide.set_color(3);
+    wide.add_colors(1);
+    wide.add_colors(3);
+    wide.add_colors(5);
+    wide.add_packed_colors(4);
+    wide.add_packed_colors(0);
+    (*wide.mutable_tints())[1] = 3;
+    (*wide.mutable_tints())[2] = 5;
+    std::string data = wide.SerializeAsString();
+    _checkpaths<tests::Node>("tests.Node", data);
+
+    int n = _call("decode", [&]{ lua_pushstring(L, "tests.Node"); lua_pushlstring(L, data.data(), data.size()); return 2; });
+    CHECK(n == 1 && lua_getfield(L, -1, "color") == LUA_TNIL);
+    lua_settop(L, top);
+
+    tests::Wide known, unknown;
+    known.set_color(1);
+    unknown.set_color(3);
+    _checkpaths<tests::Node>("tests.Node", known.SerializeAsString() + unknown.SerializeAsString());
+    _checkpaths<tests::Node>("tests.Node", unknown.SerializeAsString() + known.SerializeAsString());
+}
+
+// proto3 enums are open: an unknown value reaches lua as its number and goes back out unchanged
+static void _testopenenum()
+{
+    tests3::Flat flat;
+    int top = lua_gettop(L);
+
+    flat.set_mode((tests3::Mode)3);
+    flat.add_modes(tests3::ONE);
+    flat.add_modes((tests3::Mode)7);
+    flat.add_modes((tests3::Mode)-2);
+    std::string data = flat.SerializeAsString();
+    for (auto op : {"decode", "deserialize"})
+    {
+        int n = _call(op, [&]{ lua_pushstring(L, "tests3.Flat"); lua_pushlstring(L, data.data(), data.size()); return 2; });
+        lua_getfield(L, -1, "mode");
+        if (!CHECK(n == 1 && lua_type(L, -1) == LUA_TNUMBER && lua_tointeger(L, -1) == 3)) fprintf(stderr, "  by %s\n", op);
+        lua_settop(L, top);
+    }
+    _checkpaths<tests3::Flat>("tests3.Flat", data);
+
+    _call("decode", [&]{ lua_pushstring(L, "tests3.Flat"); lua_pushlstring(L, data.data(), data.size()); return 2; });
+    int n = _call("serialize", [&]{ lua_pushstring(L, "tests3.Flat"); lua_pushvalue(L, top + 1); return 2; });
+    tests3::Flat got;
+    CHECK(n == 1 && got.ParseFromArray(lua_tostring(L, -1), (int)lua_rawlen(L, -1)) && google::protobuf::util::MessageDifferencer::Equals(got, flat));
+    lua_settop(L, top);
+}
+
+// without strict mode a missing required field just leaves its key out
+static void _testrequired()
+{
+    tests::Node node;
+    node.mutable_leaf()->set_name("x");
+    node.add_leaves()->add_values(1);
+    (*node.mutable_named())["k"].set_name("y");
+    node.mutable_block()->mutable_inner();
+    _checkpaths<tests::Node>("tests.Node", node.SerializePartialAsString());
+
+    tests::Leaf leaf;
+    leaf.set_name("z");
+    _checkpaths<tests::Leaf>("tests.Leaf", leaf.SerializePartialAsString());
+}
+
+// one decoding call => "" when it decoded, otherwise the reason it gave
+// op is a function name, "batch", "async", "stream", or "mask" for deserialize with just the mask field
+std::string _run(const char* op, const char* type, const std::string& data, const char* mask)
+{
+    int top = lua_gettop(L), n;
+    std::string reason = "";
+
+    if (strcmp(op, "batch") == 0)
+    {
+        std::string framed;
+        {
+            google::protobuf::io::StringOutputStream stream(&framed);
+            google::protobuf::io::CodedOutputStream output(&stream);
+            output.WriteVarint32((google::protobuf::uint32)data.size());
+            output.WriteString(data);
+        }
+        n = _call("deserialize_batch", [&]{ lua_pushstring(L, type); lua_pushlstring(L, framed.data(), framed.size()); return 2; });
+        if (n == 2 && lua_istable(L, -2)) n = 1;
+    }
+    else if (strcmp(op, "async") == 0)
+    {
+        _call("deserialize_async", [&]{ lua_pushstring(L, type); lua_pushlstring(L, data.data(), data.size()); return 2; });
+        int handle = lua_gettop(L);
+        lua_getfield(L, handle, "result");
+        lua_pushvalue(L, handle);
+        lua_call(L, 1, LUA_MULTRET);
+        n = lua_gettop(L) - handle;
+    }
+    else if (strcmp(op, "stream") == 0)
+    {
+        _call("decoder", [&]{ lua_pushstring(L, type); return 1; });
+        int dec = lua_gettop(L);
+        for (size_t pos=0; pos<data.size(); pos+=3)
+        {
+            lua_getfield(L, dec, "feed");
+            lua_pushvalue(L, dec);
+            lua_pushlstring(L, data.data() + pos, std::min((size_t)3, data.size() - pos));
+            lua_call(L, 2, 2);
+            if (!lua_toboolean(L, -2))
+            {
+                reason = lua_isstring(L, -1) ? lua_tostring(L, -1) : "feed failed without a reason";
+                lua_settop(L, top);
+                return reason;
+            }
+            lua_pop(L, 2);
+        }
+        lua_getfield(L, dec, "finish");
+        lua_pushvalue(L, dec);
+        lua_call(L, 1, LUA_MULTRET);
+        n = lua_gettop(L) - dec;
+    }
+    else
+    {
+        n = _call(mask ? "deserialize" : op, [&]{
+            lua_pushstring(L, type);
+            lua_pushlstring(L, data.data(), data.size());
+            if (mask)
+            {
+                lua_newtable(L);
+                lua_pushstring(L, mask);
+                lua_rawseti(L, -2, 1);
+                return 3;
+            }
+            if (strcmp(op, "deserialize_into") == 0)
+            {
+                lua_newtable(L);
+                return 3;
+            }
+            return 2;
+        });
+    }
+
+    if (n == 2 && lua_isnil(L, -2)) reason = lua_tostring(L, -1);
+    else if (n != 1 || lua_isnil(L, -1)) reason = "unexpected results";
+    lua_settop(L, top);
+    return reason;
+}
+
+bool _startswith(const std::string& s, const char* prefix)
+{
+    return s.compare(0, strlen(prefix), prefix) == 0;
+}
+
+// msg => its table from deserialize at top, false and nothing pushed when that failed
+bool _pushmsg(const google::protobuf::Message& msg)
+{
+    std::string data = msg.SerializePartialAsString();
+    return _call("deserialize", [&]{ lua_pushstring(L, msg.GetDescriptor()->full_name().c_str()); lua_pushlstring(L, data.data(), data.size()); return 2; }) == 1;
+}
+
+// binary data => true when protobuf parses it into a message equal to want
+bool _parsesame(const google::protobuf::Message& want, const void* data, size_t sz)
+{
+    std::unique_ptr<google::protobuf::Message> got(want.New());
+    bool same = got->ParsePartialFromArray(data, (int)sz) && google::protobuf::util::MessageDifferencer::Equals(*got, want);
+    if (!same) fprintf(stderr, "  got  %s\n  want %s\n", got->ShortDebugString().c_str(), want.ShortDebugString().c_str());
+    return same;
+}
+
+// table at idx => serialize's output compared with want, like _same does for encode
+bool _serializesame(const google::protobuf::Message& want, int idx)
+{
+    idx = lua_absindex(L, idx);
+    int n = _call("serialize", [&]{ lua_pushstring(L, want.GetDescriptor()->full_name().c_str()); lua_pushvalue(L, idx); return 2; });
+    bool same = n == 1 && lua_type(L, -1) == LUA_TSTRING && _parsesame(want, lua_tostring(L, -1), lua_rawlen(L, -1));
+    if (n > 0) lua_pop(L, n);
+    return same;
+}
+
+// length prefixes past the end of the input, some beyond INT_MAX => a clean failure on every path
+static void _testlengths()
+{
+    static const char* ops[] = {"deserialize", "deserialize_into", "debugstr", "decode", "deserialize_lazy", "batch", "async", "stream", "mask"};
+    static const std::string hostile[] = {
+        std::string("\x3a\xff\xff\xff\xff\x0f" "abc"),             //raw, 2^32-1 bytes
+        std::string("\x32\x80\x80\x80\x80\x08" "abc"),             //str, 2^31 bytes
+        std::string("\x32\x10" "abc"),                                     //str, past the end
+        std::string("\xd2\x01\xf8\xff\xff\xff\x07" "abcdefgh"),       //stamps, INT_MAX-7 bytes of fixed64
+        std::string("\xd2\x01\x80\x80\x80\x80\x01" "abcdefgh"),       //stamps, 2^28 bytes of fixed64
+        std::string("\xca\x01\xff\xff\xff\xff\x0f\x02"),             //deltas, packed varints
+        std::string("\x5a\xff\xff\xff\xff\x0f\x08\x01"),             //leaf
+        std::string("\x72\xff\xff\xff\xff\x0f\x08\x01"),             //tints entry
+    };
+    int top = lua_gettop(L);
+
+    for (auto& data : hostile)
+    {
+        for (auto op : ops)
+        {
+            const char* mask = strcmp(op, "mask") == 0 ? "i32" : nullptr;
+            _run(op, "tests.Node", data, mask);       //lenient decodes keep what came before, they must just not read past the input
+            _strict(true);
+            if (!CHECK(_run(op, "tests.Node", data, mask) == "malformed message")) fprintf(stderr, "  %s accepted a hostile length\n", op);
+            _strict(false);
+        }
+
+        lua_newtable(L);
+        int n = _call("apply_delta", [&]{ lua_pushstring(L, "tests.Node"); lua_pushvalue(L, top + 1); lua_pushlstring(L, data.data(), data.size()); return 3; });
+        CHECK(n == -1);
+        lua_settop(L, top);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int rounds = 200;
+
+    for (int i=1; i<argc; i++)
+    {
+        if (i+1 < argc && strcmp(argv[i], "--rounds") == 0) rounds = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: %s [--rounds n]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    L = luaL_newstate();
+    luaL_openlibs(L);
+    luaL_requiref(L, "proto.core", LuaModule::luaopen_proto_core, 0);
+    g_lib = lua_gettop(L);
+
+    _testpaths(rounds);
+    _testenums();
+    _testopenenum();
+    _testrequired();
+    _testlengths();
+    _testdeltas(rounds);
+    _teststrict();
+    _testserializeinto(rounds);
+    _testarena(rounds);
+    _testpool(rounds);
+    _testbytesview();
+    _testbatch(rounds);
+    _testlazy(rounds);
+    _testmasks(rounds / 10 + 1);
+    _testtypedarray(rounds);
+    _testenummode(rounds);
+    _testload(rounds);
+    _testasync(rounds);
+    _testdeserializeinto(rounds);
+    _teststats();
+    _testjson(rounds);
+
+    lua_close(L);
+    printf("pass %d fail %d\n", g_pass, g_fail);
+    return g_fail ? 1 : 0;
+}
@@ -0,0 +1,88 @@
+#ifndef LUAPROTO_TESTS_H
+#define LUAPROTO_TESTS_H
+
+#include "lua/lua.hpp"
+#include "tests.pb.h"
+#include "tests3.pb.h"
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/wire_format_lite.h>
+#include <google/protobuf/util/message_differencer.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// shared by the test files, each covers the functions one part of the module added
+
+extern lua_State *L;
+extern int g_lib;
+
+#define CHECK(cond) _check((cond), #cond, __FILE__, __LINE__)
+
+bool _check(bool ok, const char* what, const char* file, int line);
+unsigned _random();
+std::string _randomstring(size_t len);
+void _option(const char* name, lua_Integer value);
+void _strict(bool on);
+void _fillleaf(tests::Leaf* pLeaf);
+tests::Color _color();
+void _fillnode(tests::Node* pNode, int depth);
+void _fillflat(tests3::Flat* pFlat);
+std::string _run(const char* op, const char* type, const std::string& data, const char* mask = nullptr);
+bool _startswith(const std::string& s, const char* prefix);
+bool _pushmsg(const google::protobuf::Message& msg);
+bool _parsesame(const google::protobuf::Message& want, const void* data, size_t sz);
+bool _serializesame(const google::protobuf::Message& want, int idx);
+
+// the parts of the module outside the decoders, one file each
+void _testserializeinto(int rounds);
+void _testarena(int rounds);
+void _testpool(int rounds);
+void _testbytesview();
+void _testbatch(int rounds);
+void _testlazy(int rounds);
+void _testmasks(int rounds);
+void _testtypedarray(int rounds);
+void _testenummode(int rounds);
+void _testload(int rounds);
+void _testasync(int rounds);
+void _testdeserializeinto(int rounds);
+void _testdeltas(int rounds);
+void _teststats();
+void _teststrict();
+void _testjson(int rounds);
+
+// lib[op] called with the values args pushes => number of results on the stack, -1 after an error
+template <class F> int _call(const char* op, F args)
+{
+    int base = lua_gettop(L);
+
+    lua_getfield(L, g_lib, op);
+    int n = args();
+    if (lua_pcall(L, n, LUA_MULTRET, 0) != LUA_OK)
+    {
+        fprintf(stderr, "%s: %s\n", op, lua_tostring(L, -1));
+        lua_settop(L, base);
+        return -1;
+    }
+    return lua_gettop(L) - base;
+}
+
+// table at idx => encoded by the module, parsed back and compared with want
+template <class M> bool _same(const char* type, int idx, const M& want)
+{
+    M got;
+
+    idx = lua_absindex(L, idx);
+    int n = _call("encode", [&]{ lua_pushstring(L, type); lua_pushvalue(L, idx); return 2; });
+    if (n != 1) return false;
+    std::string data(lua_tostring(L, -1), lua_rawlen(L, -1));
+    lua_pop(L, 1);
+
+    bool same = got.ParsePartialFromString(data) && google::protobuf::util::MessageDifferencer::Equals(got, want);
+    if (!same) fprintf(stderr, "  got  %s\n  want %s\n", got.ShortDebugString().c_str(), want.ShortDebugString().c_str());
+    return same;
+}
+
+#endif
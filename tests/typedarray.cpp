@@ -0,0 +1,117 @@
+#include "tests.h"
+
+// option("typedarray"): long numeric repeated fields as typed arrays, read out and accepted back
+
+// field of the table at idx => true when it is a typed array of type holding values
+template <class T> static bool _isarray(int idx, const char* field, const char* type, const google::protobuf::RepeatedField<T>& values)
+{
+    int top = lua_gettop(L);
+    bool ok = false;
+
+    lua_getfield(L, idx, field);
+    int arr = lua_gettop(L);
+    if (_call("arrayptr", [&]{ lua_pushvalue(L, arr); return 1; }) == 3)
+    {
+        ok = strcmp(lua_tostring(L, -1), type) == 0 && (size_t)lua_tointeger(L, -2) == (size_t)values.size()
+            && (values.empty() || memcmp(lua_touserdata(L, -3), values.data(), values.size() * sizeof(T)) == 0);
+    }
+    lua_settop(L, top);
+    return ok;
+}
+
+// metamethod of the array at idx called with (array, i, v) => its result at top, nothing for __newindex
+static void _metacall(int idx, const char* event, lua_Integer i, lua_Integer v)
+{
+    idx = lua_absindex(L, idx);
+    lua_getmetatable(L, idx);
+    lua_getfield(L, -1, event);
+    lua_remove(L, -2);
+    lua_pushvalue(L, idx);
+    lua_pushinteger(L, i);
+    lua_pushinteger(L, v);
+    lua_call(L, 3, strcmp(event, "__newindex") == 0 ? 0 : 1);
+}
+
+// lua array ops through the typed array metatable
+static void _checkops()
+{
+    int top = lua_gettop(L);
+
+    lua_createtable(L, 3, 0);
+    for (int i=1; i<=3; i++)
+    {
+        lua_pushinteger(L, i * 10);
+        lua_rawseti(L, -2, i);
+    }
+    int src = lua_gettop(L);
+    if (!CHECK(_call("array", [&]{ lua_pushstring(L, "int64"); lua_pushvalue(L, src); return 2; }) == 1)) return;
+    int arr = lua_gettop(L);
+
+    _metacall(arr, "__len", 0, 0);
+    CHECK(lua_tointeger(L, -1) == 3);
+    _metacall(arr, "__newindex", 2, 7);
+    _metacall(arr, "__index", 2, 0);
+    CHECK(lua_type(L, -1) == LUA_TNUMBER && lua_tointeger(L, -1) == 7);
+    _metacall(arr, "__index", 4, 0);
+    CHECK(lua_isnil(L, -1));
+
+    // accepted for a repeated field, converted element by element when the types differ
+    tests3::Flat want;
+    want.add_r(10);
+    want.add_r(7);
+    want.add_r(30);
+    lua_newtable(L);
+    lua_pushvalue(L, arr);
+    lua_setfield(L, -2, "r");
+    CHECK(_serializesame(want, -1));
+    CHECK(_same("tests3.Flat", -1, want));
+    lua_settop(L, arr);
+    CHECK(_call("array", [&]{ lua_pushstring(L, "double"); lua_pushvalue(L, src); return 2; }) == 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -2);
+    lua_setfield(L, -2, "r");
+    want.set_r(1, 20);
+    CHECK(_serializesame(want, -1));
+
+    CHECK(_call("array", [&]{ lua_pushstring(L, "int32"); lua_pushinteger(L, -1); return 2; }) == -1);
+    lua_settop(L, top);
+}
+
+void _testtypedarray(int rounds)
+{
+    int top = lua_gettop(L);
+
+    _option("typedarray", 4);
+    for (int i=0; i<rounds; i++)
+    {
+        tests::Node node;
+        for (unsigned j=0, n=_random() % 8; j<n; j++) node.add_deltas((int)(_random() % 2000) - 1000);
+        for (unsigned j=0, n=_random() % 8; j<n; j++) node.add_stamps((unsigned long long)_random() << 20);
+        _fillleaf(node.mutable_leaf());
+        for (unsigned j=0, n=_random() % 8; j<n; j++) node.mutable_leaf()->add_values(_random() % 100);
+
+        if (!CHECK(_pushmsg(node))) continue;
+        int t = lua_gettop(L);
+        if (node.deltas_size() >= 4) CHECK(_isarray(t, "deltas", "int32", node.deltas()));
+        if (node.stamps_size() >= 4) CHECK(_isarray(t, "stamps", "uint64", node.stamps()));
+        if (node.leaf().values_size() >= 4)
+        {
+            lua_getfield(L, t, "leaf");
+            CHECK(_isarray(-1, "values", "int32", node.leaf().values()));
+            lua_pop(L, 1);
+        }
+        if (node.deltas_size() > 0 && node.deltas_size() < 4)
+        {
+            lua_getfield(L, t, "deltas");
+            CHECK(lua_istable(L, -1));
+            lua_pop(L, 1);
+        }
+
+        // typed arrays go back out through serialize and encode alike
+        CHECK(_serializesame(node, t));
+        CHECK(_same("tests.Node", t, node));
+        lua_settop(L, top);
+    }
+    _option("typedarray", 0);
+    _checkops();
+}